@@ -7,11 +7,32 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/freezer.h>
+#include <linux/ktime.h>
+#include <linux/prefetch.h>
+#include <linux/hrtimer.h>
+#include <linux/font.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+#include <linux/workqueue.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-fence.h>
+#include <linux/sync_file.h>
+#include <linux/file.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-event.h>
 #include <media/v4l2-device.h>
 #include <media/videobuf2-vmalloc.h>
+#include <asm/unaligned.h>
+#include "ffe_v4l2.h"
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#endif
+#ifdef CONFIG_ARM64
+#include <asm/sysreg.h>
+#endif
 
 
 #define VERSION				"0.1.0"
@@ -19,23 +40,183 @@
 #define MAX_WIDTH			1920
 #define MAX_HEIGHT			1080
 #define MAX_FPS				1000
+#define MAX_DEVS			256
 
 MODULE_DESCRIPTION("V4L2 Driver with FFE");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(VERSION);
 
-static void p_release(struct device *dev)
+static unsigned int n_devs = 1;
+module_param(n_devs, uint, 0444);
+MODULE_PARM_DESC(n_devs, "number of FFE devices to create (default 1)");
+
+/*
+ * Consumer modes. Exclusive is the usual single vb2 queue per device. In
+ * broadcast mode every open file handle gets its own queue, and each frame
+ * is rendered once and copied into one buffer of every streaming handle.
+ * Round-robin also uses a queue per handle but deals consecutive frames to
+ * one handle each, with the sequence kept global so order can be rebuilt.
+ */
+enum ffe_consumer_mode {
+	FFE_CONSUMER_EXCLUSIVE,
+	FFE_CONSUMER_BROADCAST,
+	FFE_CONSUMER_ROUND_ROBIN,
+};
+
+static const char * const consumer_mode_names[] = {
+	[FFE_CONSUMER_EXCLUSIVE]	= "exclusive",
+	[FFE_CONSUMER_BROADCAST]	= "broadcast",
+	[FFE_CONSUMER_ROUND_ROBIN]	= "round-robin",
+};
+
+static unsigned int consumer_mode = FFE_CONSUMER_EXCLUSIVE;
+module_param(consumer_mode, uint, 0444);
+MODULE_PARM_DESC(consumer_mode, "0 = one queue per device (default), 1 = broadcast to a queue per file handle, 2 = deal frames round-robin across file handles");
+
+static unsigned int telemetry_records = 1024;
+module_param(telemetry_records, uint, 0444);
+MODULE_PARM_DESC(telemetry_records, "per-frame records in the mmap telemetry ring, rounded up to a power of two, 0 = off (default 1024)");
+
+static bool virtual_clock;
+module_param(virtual_clock, bool, 0644);
+MODULE_PARM_DESC(virtual_clock, "advance the frame clock only on FFE_IOC_STEP, with virtual timestamps, latched at STREAMON (default 0)");
+
+static unsigned int idle_ticks = 30;
+module_param(idle_ticks, uint, 0644);
+MODULE_PARM_DESC(idle_ticks, "park the frame clock after this many ticks without a queued buffer, 0 = never (default 30)");
+
+static unsigned int src_max_mb = 64;
+module_param(src_max_mb, uint, 0644);
+MODULE_PARM_DESC(src_max_mb, "memory for the frames of a file source, in MiB (default 64)");
+
+static bool src_lz4 = true;
+module_param(src_lz4, bool, 0644);
+MODULE_PARM_DESC(src_lz4, "store file source frames LZ4 compressed (default true)");
+
+static unsigned int src_readahead;
+module_param(src_readahead, uint, 0644);
+MODULE_PARM_DESC(src_readahead, "stream the file source with this many frames read ahead instead of loading it, 0 = load (default 0, max 32)");
+
+static unsigned int src_cache_mb = 32;
+module_param(src_cache_mb, uint, 0644);
+MODULE_PARM_DESC(src_cache_mb, "memory for source frames converted to the negotiated format, in MiB (default 32)");
+
+/*
+ * Frame fill strategy. The pattern is the same line repeated down the frame,
+ * so instead of reading the source line once per row, the doubling copy
+ * writes a block of rows and then replicates it from the already written
+ * (cache hot) destination. fill_block bounds that block so it stays in L2.
+ */
+enum ffe_fill_mode {
+	FFE_FILL_ROWS,
+	FFE_FILL_DOUBLING,
+};
+
+static const char * const fill_mode_names[] = {
+	[FFE_FILL_ROWS]			= "rows",
+	[FFE_FILL_DOUBLING]		= "doubling",
+};
+
+static unsigned int fill_mode = FFE_FILL_DOUBLING;
+module_param(fill_mode, uint, 0644);
+MODULE_PARM_DESC(fill_mode, "frame fill strategy, 0 = per-row copy, 1 = doubling copy (default)");
+
+static unsigned int fill_block = 64;
+module_param(fill_block, uint, 0644);
+MODULE_PARM_DESC(fill_block, "doubling copy block size in KiB, keep within L2 (default 64)");
+
+static bool fill_zero = true;
+module_param(fill_zero, bool, 0644);
+MODULE_PARM_DESC(fill_zero, "zero destination cache lines before writing where the CPU supports it (default on)");
+
+/*
+ * Copies are done in L1 sized chunks. The source of the next chunk is
+ * prefetched, and where the CPU can allocate a zeroed cache line without
+ * reading it (dc zva, clzero) the destination is claimed that way first,
+ * which avoids the read-for-ownership traffic of full-frame writes.
+ */
+#define FFE_COPY_CHUNK			4096
+
+struct ffe_fill_path {
+	const char			*name;
+	unsigned int			line;
+	void				(*zero_line)(void *addr);
+};
+
+static struct ffe_fill_path fill_path = {
+	.name				= "generic-prefetch",
+};
+
+#if defined(CONFIG_X86) && defined(X86_FEATURE_CLZERO)
+static void ffe_clzero(void *addr)
 {
-	dev_info(dev, "%s", __func__);
+	asm volatile(".byte 0x0f, 0x01, 0xfc" : : "a" (addr) : "memory");	/* clzero */
 }
+#endif
 
-static struct platform_device p_device = {
-	.name		= KBUILD_MODNAME,
-	.id		= PLATFORM_DEVID_NONE,
-	.dev		= {
-		.release		= p_release,
-	},
-};
+#ifdef CONFIG_ARM64
+static void ffe_dc_zva(void *addr)
+{
+	asm volatile("dc zva, %0" : : "r" (addr) : "memory");
+}
+#endif
+
+static void ffe_select_fill_path(void)
+{
+#if defined(CONFIG_X86) && defined(X86_FEATURE_CLZERO)
+	if (boot_cpu_has(X86_FEATURE_CLZERO)) {
+		fill_path.name = "x86-clzero";
+		fill_path.line = 64;
+		fill_path.zero_line = ffe_clzero;
+	}
+#endif
+#ifdef CONFIG_ARM64
+	u64 dczid = read_sysreg(dczid_el0);
+
+	if (!(dczid & BIT(4))) {					/* DZP, dc zva prohibited */
+		fill_path.name = "arm64-dczva";
+		fill_path.line = 4 << (dczid & 0xf);
+		fill_path.zero_line = ffe_dc_zva;
+	}
+#endif
+	pr_info("%s: %s, %u byte lines\n", __func__, fill_path.name, fill_path.line);
+}
+
+static void ffe_zero_lines(u8 *dst, unsigned int len)
+{
+	unsigned int line = fill_path.line;
+	uintptr_t p, end;
+
+	p = ALIGN((uintptr_t)dst, line);
+	end = round_down((uintptr_t)dst + len, line);
+	for (; p < end; p += line)
+		fill_path.zero_line((void *)p);
+}
+
+/*
+ * zero says dst is ordinary cacheable memory. Cache line zeroing faults on
+ * device or write-combined memory, which a USERPTR or DMABUF buffer may be.
+ */
+static void ffe_copy(u8 *dst, const u8 *src, unsigned int len, bool zero)
+{
+	unsigned int n;
+
+	zero = zero && fill_path.line && READ_ONCE(fill_zero);
+
+	while (len) {
+		n = min_t(unsigned int, len, FFE_COPY_CHUNK);
+		if (len > n)
+			prefetch_range((void *)(src + n), min_t(unsigned int, len - n, FFE_COPY_CHUNK));
+		if (zero)
+			ffe_zero_lines(dst, n);
+		memcpy(dst, src, n);
+		dst += n;
+		src += n;
+		len -= n;
+	}
+}
+
+static struct platform_device *p_devices[MAX_DEVS];
 
 static const struct v4l2_fract
 	tpf_min = {.numerator = 1, .denominator = MAX_FPS},
@@ -47,8 +228,14 @@ struct ffe_fmt {
 	u32				fourcc;
 	u8				depth;
 	bool				is_yuv;
+	bool				is_depth;		/* depth or IR samples, no colour */
+	u8				tile_w, tile_h;		/* tiled NV12, 0 = packed */
 };
 
+#ifndef V4L2_PIX_FMT_NV12_4L4
+#define V4L2_PIX_FMT_NV12_4L4		v4l2_fourcc('V', 'T', '1', '2')	/* 12  Y/CbCr 4:2:0 4x4 tiles */
+#endif
+
 static struct ffe_fmt formats[] = {
 	{
 		.name			= "4:2:2, packed, YUYV",
@@ -114,6 +301,40 @@ static struct ffe_fmt formats[] = {
 		.fourcc			= V4L2_PIX_FMT_BGR32,
 		.depth			= 32,
 	},
+	{
+		.name			= "16-bit depth, Z16",
+		.fourcc			= V4L2_PIX_FMT_Z16,
+		.depth			= 16,
+		.is_depth		= true,
+	},
+	{
+		.name			= "Interleaved 8-bit IR, Y8I",
+		.fourcc			= V4L2_PIX_FMT_Y8I,
+		.depth			= 16,
+		.is_depth		= true,
+	},
+	{
+		.name			= "Interleaved 12-bit IR, Y12I",
+		.fourcc			= V4L2_PIX_FMT_Y12I,
+		.depth			= 24,
+		.is_depth		= true,
+	},
+	{
+		.name			= "4:2:0, NV12, 16x16 tiles",
+		.fourcc			= V4L2_PIX_FMT_HM12,
+		.depth			= 12,
+		.is_yuv			= true,
+		.tile_w			= 16,
+		.tile_h			= 16,
+	},
+	{
+		.name			= "4:2:0, NV12, 4x4 tiles",
+		.fourcc			= V4L2_PIX_FMT_NV12_4L4,
+		.depth			= 12,
+		.is_yuv			= true,
+		.tile_w			= 4,
+		.tile_h			= 4,
+	},
 };
 
 static struct ffe_fmt *get_format(u32 pixelformat)
@@ -133,38 +354,295 @@ static struct ffe_fmt *get_format(u32 pixelformat)
 	return &formats[i];
 }
 
+/* Bytes of a whole frame, tiled formats keep both planes in the one buffer */
+static size_t ffe_image_size(const struct ffe_fmt *fmt, unsigned int width, unsigned int height)
+{
+	return ((size_t)width * height * fmt->depth) >> 3;
+}
+
+/* Packed colour formats, the ones the converters, HDR gains and layouts handle */
+static bool ffe_fmt_packed(const struct ffe_fmt *fmt)
+{
+	return !fmt->is_depth && !fmt->tile_w;
+}
+
 struct ffe_buffer {
-	struct vb2_buffer		vb;
+	struct vb2_v4l2_buffer		vb;
 	struct list_head		list;
-	struct v4l2_buffer		v4l2_buf;
+	struct dma_fence		*fence;			/* from buffer_queue() until the frame is in */
 };
 
-struct ffe_dmaq {
+struct ffe_consumer {
+	struct dev_data			*dev;
+	struct vb2_queue		queue;
+	struct mutex			lock;			/* queue ioctls, never held with dev->mutex first */
 	struct list_head		active;
+	struct list_head		node;			/* on ffe_dmaq.consumers while streaming */
+	unsigned int			delivered, dropped;
+	u64				fence_ctx;		/* buffers of one queue complete in order */
+	unsigned int			fence_seqno;
+};
+
+struct ffe_fh {
+	struct v4l2_fh			fh;
+	struct ffe_consumer		cons;
+};
+
+struct ffe_dmaq {
+	struct list_head		consumers;
 	struct task_struct		*kthread;
 	wait_queue_head_t		wq;
-	int				frame;
-	int				jiffies;
+	u64				frame;			/* frame clock ticks since STREAMON */
+	ktime_t				next;			/* deadline of the next tick */
+	unsigned int			starved;		/* consecutive ticks without a buffer */
+	bool				parked;
+	bool				rebase;			/* restart pacing from now on the next tick */
+	bool				virt;			/* next is virtual time, ticks only on FFE_IOC_STEP */
+	atomic_t			steps;			/* ticks still to run */
+};
+
+/*
+ * On-screen display. Glyphs of the kernel 8x16 font are pre-rendered into an
+ * atlas in the negotiated pixel format whenever the pattern is built, so per
+ * frame only the overlay rectangle is written, one glyph row at a time.
+ */
+#define OSD_FIRST_CHAR			32
+#define OSD_LAST_CHAR			126
+#define OSD_GLYPHS			(OSD_LAST_CHAR - OSD_FIRST_CHAR + 1)
+#define OSD_FONT_W			8
+#define OSD_FONT_H			16
+#define OSD_MARGIN			16
+#define OSD_TEXT_MAX			32
+
+enum ffe_osd_mode {
+	FFE_OSD_OFF,
+	FFE_OSD_COUNTERS,
+	FFE_OSD_TEXT,
+	FFE_OSD_ALL,
+};
+
+/*
+ * Multi-sensor composites: the frame is split into one tile per sensor, each
+ * filled from the cached pattern line at its own phase plus a disparity
+ * shift of k * disparity pixels for sensor k.
+ */
+enum ffe_layout {
+	FFE_LAYOUT_MONO,
+	FFE_LAYOUT_SIDE_BY_SIDE,
+	FFE_LAYOUT_TOP_BOTTOM,
+	FFE_LAYOUT_TILED,
+};
+
+#define FFE_SENSORS_MAX			4
+
+struct ffe_composite {
+	unsigned int			layout;
+	unsigned int			sensors;		/* FFE_LAYOUT_TILED only */
+	unsigned int			disparity;		/* pixels, even */
+};
+
+/*
+ * Depth patterns for Z16 and the interleaved IR pairs, in millimetres. The
+ * IR pair is lit like a projector, falling off to black at the far plane,
+ * and the right image is the left one shifted by the disparity control.
+ */
+enum ffe_depth_pattern {
+	FFE_DEPTH_RAMP,
+	FFE_DEPTH_PLANE,
+	FFE_DEPTH_OBJECT,
+};
+
+#define FFE_DEPTH_NEAR			500
+#define FFE_DEPTH_FAR			4000
+#define FFE_DEPTH_IR_SCALE		((4095 << 16) / (FFE_DEPTH_FAR - FFE_DEPTH_NEAR))
+
+struct ffe_depth {
+	unsigned int			pattern;
+	__le16				*row;			/* MAX_WIDTH Z16 samples */
+};
+
+#define FFE_SRC_PATH_MAX		255
+#define FFE_SRC_CACHE_MAX		32
+#define FFE_SRC_RA_MAX			32
+
+struct ffe_src_slot {
+	u8				*buf;
+	int				frame;			/* -1 when empty */
+	unsigned int			used;			/* f_count of the last hit, for LRU */
+};
+
+/* len below the frame size means the frame is stored LZ4 compressed */
+struct ffe_src_frame {
+	u8				*data;
+	u32				len;
+};
+
+/* One frame of the readahead ring, valid for tick when ready */
+struct ffe_ra_slot {
+	u8				*buf;
+	unsigned int			tick;
+	bool				ready;
+};
+
+/*
+ * RGB <-> Y'CbCr conversion expanded into per-component lookup tables, so a
+ * generator converts a pixel with nine loads and no multiplies.  The 0.5
+ * rounding term is folded into the R column and the luma table.
+ */
+struct ffe_csc {
+	s32				y[3][256];
+	s32				cb[3][256];
+	s32				cr[3][256];
+	u8				y_offset;
+	s32				luma[256];		/* and back again */
+	s32				r_cr[256], g_cb[256];
+	s32				g_cr[256], b_cb[256];
+};
+
+struct ffe_source {
+	char				path[FFE_SRC_PATH_MAX + 1];
+	const struct ffe_fmt		*fmt;
+	unsigned int			width, height;
+	size_t				frame_size;
+	unsigned int			n_frames;
+	struct ffe_src_frame		*frames;
+	u64				stored;			/* bytes held for all frames */
+	size_t				charged;		/* FFE_MEM_SOURCE bytes, but the cache */
+	size_t				cache_bytes;
+	u8				*stage;			/* one raw frame */
+	bool				stale, mismatch;
+	u8				*scratch;		/* one row of R, G, B triplets */
+	unsigned int			colorimetry;		/* csc_matrices[] entry of a Y'CbCr clip */
+	struct ffe_csc			csc;			/* its Y'CbCr -> RGB tables */
+	struct ffe_src_slot		cache[FFE_SRC_CACHE_MAX];
+	unsigned int			n_slots;
+	unsigned int			hits, misses, evictions;
+	u64				convert_ns;
+	u64				lz4_ns, lz4_bytes;
+	struct file			*filp;			/* streaming from the file */
+	struct work_struct		ra_work;
+	spinlock_t			ra_lock;		/* ring state vs. the readahead work */
+	struct ffe_ra_slot		ring[FFE_SRC_RA_MAX + 1];
+	unsigned int			ra_size, ra_want;
+	int				ra_pinned;		/* slot last delivered, repeated on a miss */
+	unsigned int			ra_hits, ra_misses, ra_errors;
+};
+
+#define FFE_TRACE_MAX			(1 << 20)
+
+struct ffe_trace {
+	char				path[FFE_SRC_PATH_MAX + 1];
+	struct ffe_trace_record		*recs;			/* from kernel_read_file_from_path() */
+	unsigned int			n, pos;			/* pos is the record of the current tick */
+	s32				ts_offset;
+	unsigned int			drops;
+};
+
+/*
+ * Staggered HDR: each output frame period is split into up to three
+ * exposures, longest first, delivered as consecutive buffers. Exposure e of
+ * sequence s is s % exposures.
+ */
+#define FFE_HDR_MAX			3
+
+struct ffe_hdr {
+	unsigned int			exposures;		/* 1 = off */
+	u8				*line[FFE_HDR_MAX];	/* pattern line at each gain */
+	u8				*rgb;			/* MAX_WIDTH unpacked triplets */
+	u8				lut[FFE_HDR_MAX][256];	/* luma or R'G'B' */
+	u8				clut[FFE_HDR_MAX][256];	/* chroma */
+	u64				frames[FFE_HDR_MAX];
+};
+
+/*
+ * Memory accounting. Per-device totals by category are exported under
+ * memory/ in sysfs and in LOG_STATUS. Memory allocated on behalf of an
+ * opener is also charged to its memcg with GFP_KERNEL_ACCOUNT.
+ */
+enum ffe_mem_type {
+	FFE_MEM_BUFFERS,
+	FFE_MEM_PATTERN,
+	FFE_MEM_SOURCE,
+	FFE_MEM_TELEMETRY,
+	FFE_MEM_NR,
+};
+
+static const char * const ffe_mem_names[] = {
+	[FFE_MEM_BUFFERS]		= "buffers",
+	[FFE_MEM_PATTERN]		= "pattern",
+	[FFE_MEM_SOURCE]		= "source",
+	[FFE_MEM_TELEMETRY]		= "telemetry",
 };
 
 struct dev_data {
 	struct platform_device		*pdev;
 	struct v4l2_device		v4l2_dev;
+	struct v4l2_ctrl_handler	ctrl_handler;
 	struct video_device		vdev;
 	struct mutex			mutex;
-	struct vb2_queue		queue;
+	struct mutex			gen_lock;		/* consumer membership vs. an in-flight frame */
+	seqcount_t			fmt_seq;		/* format and frame interval, written under mutex */
+	struct ffe_consumer		cons;			/* exclusive mode */
 	struct ffe_dmaq			vidq;
 	struct ffe_fmt			*fmt;
 	struct v4l2_fract		time_per_frame;
 	spinlock_t			s_lock;
+	spinlock_t			fence_lock;
 	unsigned long			jiffies;
 	int				mv_count, input;
-	unsigned int			f_count;
+	unsigned int			f_count, dropped;
 	unsigned int			width, height, pixelsize;
+	u64				fill_ns, fill_bytes;
+	unsigned int			fill_frames;
+	u64				stream_ns, ttff_ns;
+	unsigned int			suspend_count;
+	unsigned int			consumer_mode, streaming;
+	bool				queue_ready, pattern_valid;
+	u32				colorspace, ycbcr_enc;
+	u32				quantization, xfer_func;
+	struct ffe_csc			csc;			/* built for ycbcr_enc/quantization */
 	u8				bars[8][3], alpha;
-	u8				line[MAX_WIDTH * 8];
+	u8				*line;			/* MAX_WIDTH * 8, allocated on first use */
+	u8				*tile_uv;		/* chroma line of the tiled formats */
+	u8				*osd_atlas;		/* OSD_GLYPHS glyphs in the current format */
+	bool				osd_ready;
+	unsigned int			osd_mode;
+	char				osd_text[OSD_TEXT_MAX + 1];
+	u64				osd_ns;
+	struct ffe_source		src;
+	struct ffe_trace		trace;
+	struct ffe_hdr			hdr;
+	struct ffe_composite		comp;
+	struct ffe_depth		depth;
+	struct ffe_telemetry_header	*telemetry;		/* vmalloc_user on first mmap, mapped read-only */
+	size_t				telemetry_size;		/* 0 = off */
+	atomic_long_t			mem[FFE_MEM_NR];	/* bytes held per ffe_mem_type */
+	struct shrinker			shrinker;
+	bool				shrinker_registered;
+	unsigned long			reclaimed;		/* cache objects freed by the shrinker, under mutex */
+	struct mutex			import_lock;
+	struct list_head		imports;		/* ffe_import, most recently used first */
+	unsigned int			n_imports;
+	unsigned int			import_maps, import_hits;
+	spinlock_t			exports_lock;
+	struct list_head		exports;		/* ffe_mem freed by vb2, pages still exported */
 };
 
+static void ffe_mem_account(struct dev_data *dev, enum ffe_mem_type type, long bytes)
+{
+	atomic_long_add(bytes, &dev->mem[type]);
+}
+
+/* Pattern lines and scratch rows, kept for the life of the device */
+static void *ffe_pattern_alloc(struct dev_data *dev, size_t size)
+{
+	void *p = devm_kzalloc(&dev->pdev->dev, size, GFP_KERNEL);
+
+	if (p)
+		ffe_mem_account(dev, FFE_MEM_PATTERN, size);
+	return p;
+}
+
 /* ------------------------------------ {    R,    G,    B} */
 
 #define COLOR_WHITE			{ 0xFF, 0xFF, 0xFF}
@@ -181,9 +659,155 @@ static const u8 bar[8][3] = {
 	COLOR_WHITE, COLOR_YELLOW, COLOR_CYAN, COLOR_GREEN, COLOR_MAGENTA, COLOR_RED, COLOR_BLUE, COLOR_BLACK
 };
 
+/* ----------RGB -> Y'CbCr matrices, 16.16 fixed point---------- */
+struct ffe_csc_matrix {
+	u32				ycbcr_enc;
+	u32				quantization;
+	s32				coef[3][3];		/* rows Y, Cb, Cr; columns R, G, B */
+	s32				inverse[4];		/* Cr->R, Cb->G, Cr->G, Cb->B */
+	s32				y_gain;
+	u8				y_offset;
+};
+
+static const struct ffe_csc_matrix csc_matrices[] = {
+	{
+		.ycbcr_enc		= V4L2_YCBCR_ENC_601,
+		.quantization		= V4L2_QUANTIZATION_LIM_RANGE,
+		.coef			= { { 16829, 33039,  6416 },
+					    { -9714, -19070, 28784 },
+					    { 28784, -24103, -4681 } },
+		.inverse		= { 104597, 25675, 53279, 132201 },
+		.y_gain			= 76309,
+		.y_offset		= 16,
+	},
+	{
+		.ycbcr_enc		= V4L2_YCBCR_ENC_601,
+		.quantization		= V4L2_QUANTIZATION_FULL_RANGE,
+		.coef			= { { 19595, 38470,  7471 },
+					    { -11058, -21710, 32768 },
+					    { 32768, -27439, -5329 } },
+		.inverse		= { 91881, 22553, 46802, 116130 },
+		.y_gain			= 65536,
+		.y_offset		= 0,
+	},
+	{
+		.ycbcr_enc		= V4L2_YCBCR_ENC_709,
+		.quantization		= V4L2_QUANTIZATION_LIM_RANGE,
+		.coef			= { { 11966, 40254,  4064 },
+					    { -6596, -22189, 28784 },
+					    { 28784, -26145, -2639 } },
+		.inverse		= { 117489, 13975, 34925, 138438 },
+		.y_gain			= 76309,
+		.y_offset		= 16,
+	},
+	{
+		.ycbcr_enc		= V4L2_YCBCR_ENC_709,
+		.quantization		= V4L2_QUANTIZATION_FULL_RANGE,
+		.coef			= { { 13933, 46871,  4732 },
+					    { -7509, -25259, 32768 },
+					    { 32768, -29763, -3005 } },
+		.inverse		= { 103206, 12276, 30679, 121609 },
+		.y_gain			= 65536,
+		.y_offset		= 0,
+	},
+	{
+		.ycbcr_enc		= V4L2_YCBCR_ENC_BT2020,
+		.quantization		= V4L2_QUANTIZATION_LIM_RANGE,
+		.coef			= { { 14786, 38160,  3338 },
+					    { -8038, -20746, 28784 },
+					    { 28784, -26469, -2315 } },
+		.inverse		= { 110014, 12277, 42626, 140363 },
+		.y_gain			= 76309,
+		.y_offset		= 16,
+	},
+	{
+		.ycbcr_enc		= V4L2_YCBCR_ENC_BT2020,
+		.quantization		= V4L2_QUANTIZATION_FULL_RANGE,
+		.coef			= { { 17216, 44433,  3886 },
+					    { -9151, -23617, 32768 },
+					    { 32768, -30133, -2635 } },
+		.inverse		= { 96639, 10784, 37444, 123299 },
+		.y_gain			= 65536,
+		.y_offset		= 0,
+	},
+};
+
+static const struct ffe_csc_matrix *ffe_find_csc(u32 ycbcr_enc, u32 quantization)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(csc_matrices); i++)
+		if (csc_matrices[i].ycbcr_enc == ycbcr_enc &&
+		    csc_matrices[i].quantization == quantization)
+			return &csc_matrices[i];
+	return &csc_matrices[0];
+}
+
+static void ffe_fill_csc(struct ffe_csc *csc, const struct ffe_csc_matrix *m)
+{
+	int c, v;
+
+	for (c = 0; c < 3; c++) {
+		for (v = 0; v < 256; v++) {
+			csc->y[c][v] = m->coef[0][c] * v;
+			csc->cb[c][v] = m->coef[1][c] * v;
+			csc->cr[c][v] = m->coef[2][c] * v;
+		}
+	}
+	for (v = 0; v < 256; v++) {
+		csc->y[0][v] += 32768;
+		csc->cb[0][v] += 32768;
+		csc->cr[0][v] += 32768;
+	}
+	csc->y_offset = m->y_offset;
+
+	for (v = 0; v < 256; v++) {
+		csc->luma[v] = m->y_gain * (v - m->y_offset) + 32768;
+		csc->r_cr[v] = m->inverse[0] * (v - 128);
+		csc->g_cb[v] = m->inverse[1] * (v - 128);
+		csc->g_cr[v] = m->inverse[2] * (v - 128);
+		csc->b_cb[v] = m->inverse[3] * (v - 128);
+	}
+}
+
+/* The output tables follow the format; a clip keeps its own colorimetry */
+static void ffe_build_csc(struct dev_data *dev)
+{
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	ffe_fill_csc(&dev->csc, ffe_find_csc(dev->ycbcr_enc, dev->quantization));
+	ffe_fill_csc(&dev->src.csc, &csc_matrices[dev->src.colorimetry]);
+}
+
+/* Full-range chroma of a saturated primary rounds to 256, hence the clamp */
+static inline void ffe_rgb_to_ycbcr(const struct ffe_csc *csc, u8 r, u8 g, u8 b, u8 *yuv)
+{
+	int y, cb, cr;
+
+	y = ((csc->y[0][r] + csc->y[1][g] + csc->y[2][b]) >> 16) + csc->y_offset;
+	cb = ((csc->cb[0][r] + csc->cb[1][g] + csc->cb[2][b]) >> 16) + 128;
+	cr = ((csc->cr[0][r] + csc->cr[1][g] + csc->cr[2][b]) >> 16) + 128;
+	yuv[0] = clamp(y, 0, 255);
+	yuv[1] = clamp(cb, 0, 255);
+	yuv[2] = clamp(cr, 0, 255);
+}
+
+static inline void ffe_ycbcr_to_rgb(const struct ffe_csc *csc, u8 y, u8 cb, u8 cr, u8 *rgb)
+{
+	int l = csc->luma[y];
+	int r, g, b;
+
+	r = (l + csc->r_cr[cr]) >> 16;
+	g = (l - csc->g_cb[cb] - csc->g_cr[cr]) >> 16;
+	b = (l + csc->b_cb[cb]) >> 16;
+	rgb[0] = clamp(r, 0, 255);
+	rgb[1] = clamp(g, 0, 255);
+	rgb[2] = clamp(b, 0, 255);
+}
+
 static void generate_color_pix(struct dev_data *dev, u8 *buf, int colorpos, bool odd)
 {
 	u8 r_y, g_u, b_v, alpha;
+	u32 z, ir;
 	u8 *p;
 	int color;
 
@@ -193,6 +817,11 @@ static void generate_color_pix(struct dev_data *dev, u8 *buf, int colorpos, bool
 	g_u = dev->bars[colorpos][1];			/* G or U component */
 	b_v = dev->bars[colorpos][2];			/* B or V component */
 
+	/* depth formats show luma as distance, bright is near, and as IR level */
+	z = FFE_DEPTH_FAR - (FFE_DEPTH_FAR - FFE_DEPTH_NEAR) * r_y / 255;
+	ir = r_y << 4 | r_y >> 4;
+	ir |= ir << 12;
+
 	for (color = 0; color < dev->pixelsize; color++) {
 		p = buf + color;
 
@@ -335,6 +964,19 @@ static void generate_color_pix(struct dev_data *dev, u8 *buf, int colorpos, bool
 				break;
 			}
 			break;
+		case V4L2_PIX_FMT_Z16:
+			*p = z >> (8 * color);
+			break;
+		case V4L2_PIX_FMT_Y8I:
+			*p = r_y;
+			break;
+		case V4L2_PIX_FMT_Y12I:
+			*p = ir >> (8 * color);
+			break;
+		case V4L2_PIX_FMT_HM12:
+		case V4L2_PIX_FMT_NV12_4L4:
+			*p = r_y;
+			break;
 		}
 	}
 }
@@ -345,7 +987,7 @@ static void generate_colorbar(struct dev_data *dev)
 	int i;
 	bool is_yuv;
 	unsigned int pixelsize, pixelsize2;
-	int colorpos;
+	int colorpos, x;
 	u8 *pos;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
@@ -372,10 +1014,8 @@ static void generate_colorbar(struct dev_data *dev)
 			break;
 		}
 
-		if (is_yuv) {
-			dev->bars[i][0] = (((16829 * r + 33039 * g + 6416 * b  + 32768) >> 16) + 16);		/* Luma Y */
-			dev->bars[i][1] = (((-9714 * r - 19070 * g + 28784 * b + 32768) >> 16) + 128);		/* Chrominanace Cb or U */
-			dev->bars[i][2] = (((28784 * r - 24103 * g - 4681 * b  + 32768) >> 16) + 128);		/* Chrominance Cr or V */
+		if (is_yuv || dev->fmt->is_depth) {
+			ffe_rgb_to_ycbcr(&dev->csc, r, g, b, dev->bars[i]);	/* Y, Cb or U, Cr or V */
 		} else {
 			dev->bars[i][0] = r;
 			dev->bars[i][1] = g;
@@ -396,6 +1036,12 @@ static void generate_colorbar(struct dev_data *dev)
 		generate_color_pix(dev, &pix[0], colorpos % 8, 0);
 		generate_color_pix(dev, &pix[pixelsize], colorpos % 8, 1);
 
+		/* tiled NV12 keeps luma in the line and Cb Cr pairs in tile_uv */
+		for (x = w; dev->fmt->tile_w && x < wend; x += 2) {
+			dev->tile_uv[x] = dev->bars[colorpos % 8][1];
+			dev->tile_uv[x + 1] = dev->bars[colorpos % 8][2];
+		}
+
 		while (w < wend) {
 			memcpy(pos, pix, pixelsize2);
 			pos += pixelsize2;
@@ -404,101 +1050,2095 @@ static void generate_colorbar(struct dev_data *dev)
 	}
 }
 
-static void ffe_fillbuff(struct dev_data *dev, struct ffe_buffer *buf)
+static int ffe_build_osd_atlas(struct dev_data *dev)
 {
-	void *vbuf = vb2_plane_vaddr(&buf->vb, 0);
-	int size, height, i;
-	u8 *start;
+	const struct font_desc *font;
+	unsigned int ps = dev->pixelsize;
+	unsigned int gsize = OSD_FONT_W * ps;
+	unsigned int g, r, x;
+	const u8 *bits;
+	u8 fg[8], bg[8];
+	u8 *dst;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (!vbuf) {
-		v4l2_err(&dev->v4l2_dev, "%s: buffer error..\n", __func__);
-		return;
+	dev->osd_ready = false;
+	/* glyph rows are blitted linearly, which would scatter across tiles */
+	if (dev->fmt->tile_w)
+		return 0;
+
+	font = find_font("VGA8x16");
+	if (!font) {
+		v4l2_warn(&dev->v4l2_dev, "%s: VGA8x16 font not available, OSD disabled\n", __func__);
+		return 0;
 	}
 
-	size = dev->width * dev->pixelsize;
-	height = dev->height;
-	start = dev->line + (dev->mv_count % dev->width) * dev->pixelsize;
+	if (!dev->osd_atlas) {
+		dev->osd_atlas = kvzalloc(OSD_GLYPHS * OSD_FONT_H * OSD_FONT_W * 4, GFP_KERNEL);
+		if (!dev->osd_atlas)
+			return -ENOMEM;
+		ffe_mem_account(dev, FFE_MEM_PATTERN, OSD_GLYPHS * OSD_FONT_H * OSD_FONT_W * 4);
+	}
 
-	for (i = 0; i < height; i++)
-		memcpy(vbuf + i * size, start, size);
+	/* white on black, even and odd pixel so packed YUV keeps its chroma order */
+	generate_color_pix(dev, &fg[0], 0, 0);
+	generate_color_pix(dev, &fg[ps], 0, 1);
+	generate_color_pix(dev, &bg[0], 7, 0);
+	generate_color_pix(dev, &bg[ps], 7, 1);
+
+	for (g = 0; g < OSD_GLYPHS; g++) {
+		bits = (const u8 *)font->data + (g + OSD_FIRST_CHAR) * OSD_FONT_H;
+		for (r = 0; r < OSD_FONT_H; r++) {
+			dst = dev->osd_atlas + (g * OSD_FONT_H + r) * gsize;
+			for (x = 0; x < OSD_FONT_W; x++)
+				memcpy(dst + x * ps, ((bits[r] & (0x80 >> x)) ? fg : bg) + (x & 1) * ps, ps);
+		}
+	}
 
-	dev->mv_count += 2;
-	buf->v4l2_buf.field = V4L2_FIELD_INTERLACED;
-	buf->v4l2_buf.sequence = dev->f_count++;
+	dev->osd_ready = true;
+	return 0;
 }
 
-static void ffe_thread_tick(struct dev_data *dev)
+/* Exposure gains in 1/256 of the pattern, longest first */
+static const u16 hdr_gains[FFE_HDR_MAX][FFE_HDR_MAX] = {
+	{ 256 },
+	{ 1024, 64 },
+	{ 1024, 256, 64 },
+};
+
+static const char * const hdr_names[FFE_HDR_MAX][FFE_HDR_MAX] = {
+	{ "" },
+	{ "L", "S" },
+	{ "L", "M", "S" },
+};
+
+static unsigned int ffe_hdr_exposure(struct dev_data *dev)
 {
-	struct ffe_dmaq *q;
-	struct ffe_buffer *buf;
-	unsigned long flags = 0;
+	return dev->hdr.exposures > 1 ? dev->f_count % dev->hdr.exposures : 0;
+}
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	q = &dev->vidq;
-	spin_lock_irqsave(&dev->s_lock, flags);
+static void ffe_osd_puts(struct dev_data *dev, u8 *vbuf, unsigned int x, unsigned int y, const char *text)
+{
+	unsigned int ps = dev->pixelsize;
+	unsigned int stride = dev->width * ps;
+	unsigned int gsize = OSD_FONT_W * ps;
+	const u8 *glyph;
+	unsigned int r;
+	u8 *dst;
+	int c;
+
+	if (y + OSD_FONT_H > dev->height)
+		return;
 
-	if (list_empty(&q->active)) {
-		v4l2_err(&dev->v4l2_dev, "%s: No active queue\n", __func__);
-		spin_unlock_irqrestore(&dev->s_lock, flags);
+	for (; *text && x + OSD_FONT_W <= dev->width; text++, x += OSD_FONT_W) {
+		c = *text;
+		if (c < OSD_FIRST_CHAR || c > OSD_LAST_CHAR)
+			c = '?';
+		glyph = dev->osd_atlas + (c - OSD_FIRST_CHAR) * OSD_FONT_H * gsize;
+		dst = vbuf + y * stride + x * ps;
+		for (r = 0; r < OSD_FONT_H; r++)
+			memcpy(dst + r * stride, glyph + r * gsize, gsize);
+	}
+}
+
+static void ffe_osd_draw(struct dev_data *dev, struct ffe_buffer *buf, u8 *vbuf)
+{
+	unsigned int mode = READ_ONCE(dev->osd_mode);
+	unsigned int y = OSD_MARGIN;
+	char text[OSD_TEXT_MAX + 1];
+	unsigned long flags = 0;
+	u64 start_ns, secs;
+	u32 nsecs;
+
+	if (mode == FFE_OSD_OFF || !dev->osd_ready)
 		return;
+
+	start_ns = ktime_get_ns();
+	if (mode == FFE_OSD_COUNTERS || mode == FFE_OSD_ALL) {
+		secs = div_u64_rem(buf->vb.vb2_buf.timestamp, NSEC_PER_SEC, &nsecs);
+		snprintf(text, sizeof(text), "%08u %llu.%06u %s", buf->vb.sequence, secs, nsecs / 1000,
+			 hdr_names[dev->hdr.exposures - 1][ffe_hdr_exposure(dev)]);
+		ffe_osd_puts(dev, vbuf, OSD_MARGIN, y, text);
+		y += OSD_FONT_H;
 	}
 
-	buf = list_entry(q->active.next, struct ffe_buffer, list);
-	list_del(&buf->list);
-	spin_unlock_irqrestore(&dev->s_lock, flags);
-	ffe_fillbuff(dev, buf);
-	vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
+	if (mode == FFE_OSD_TEXT || mode == FFE_OSD_ALL) {
+		spin_lock_irqsave(&dev->s_lock, flags);
+		strlcpy(text, dev->osd_text, sizeof(text));
+		spin_unlock_irqrestore(&dev->s_lock, flags);
+		ffe_osd_puts(dev, vbuf, OSD_MARGIN, y, text);
+	}
+	dev->osd_ns += ktime_get_ns() - start_ns;
 }
 
-static void ffe_sleep(struct dev_data *dev)
+/*
+ * vb2 memory ops wrapping vb2_vmalloc_memops. Every buffer gets an ffe_mem so
+ * that MMAP buffers are accounted to their device and imported dma-bufs keep
+ * their kernel mapping between QBUFs.
+ */
+struct ffe_mem {
+	void				*priv;			/* vb2_vmalloc_memops buffer */
+	struct dev_data			*owner;			/* MMAP buffers, for accounting */
+	unsigned long			size;
+	struct ffe_import		*import;		/* DMABUF buffers */
+	struct list_head		node;			/* on dev_data.exports */
+};
+
+static struct ffe_mem *ffe_mem_new(void *priv)
 {
-	struct ffe_dmaq *q = &dev->vidq;
-	int timeout;
-	DECLARE_WAITQUEUE(wait, current);
+	struct ffe_mem *mem;
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	add_wait_queue(&q->wq, &wait);
+	mem = kzalloc(sizeof(*mem), GFP_KERNEL_ACCOUNT);
+	if (!mem)
+		return NULL;
+	mem->priv = priv;
+	return mem;
+}
 
-	if (kthread_should_stop()) {
-		v4l2_err(&dev->v4l2_dev, "%s: kthread should stop\n", __func__);
-		remove_wait_queue(&q->wq, &wait);
-		try_to_freeze();
-		return;
+/*
+ * An MMAP buffer exported with EXPBUF (or still mapped) keeps its pages after
+ * vb2 frees it: the dma-buf holds its own reference on the vb2_vmalloc buffer.
+ * Such buffers stay on dev->exports, still counted, until ours is the last
+ * reference left. Those are released here, or every one of them with all.
+ */
+static void ffe_mem_reap(struct dev_data *dev, bool all)
+{
+	struct ffe_mem *mem, *tmp;
+	LIST_HEAD(done);
+
+	spin_lock(&dev->exports_lock);
+	list_for_each_entry_safe(mem, tmp, &dev->exports, node)
+		if (all || vb2_vmalloc_memops.num_users(mem->priv) == 1)
+			list_move(&mem->node, &done);
+	spin_unlock(&dev->exports_lock);
+
+	list_for_each_entry_safe(mem, tmp, &done, node) {
+		ffe_mem_account(dev, FFE_MEM_BUFFERS, -(long)mem->size);
+		vb2_vmalloc_memops.put(mem->priv);
+		kfree(mem);
 	}
+}
 
-	timeout = msecs_to_jiffies((dev->time_per_frame.numerator * 1000) / dev->time_per_frame.denominator);
-	ffe_thread_tick(dev);
-	schedule_timeout_interruptible(timeout);
-	remove_wait_queue(&q->wq, &wait);
-	try_to_freeze();
+static void *ffe_mem_alloc(struct device *dev, unsigned long attrs, unsigned long size,
+			   enum dma_data_direction dma_dir, gfp_t gfp_flags)
+{
+	void *priv = vb2_vmalloc_memops.alloc(dev, attrs, size, dma_dir, gfp_flags);
+	struct ffe_mem *mem;
+
+	if (IS_ERR_OR_NULL(priv))
+		return priv;
+	mem = ffe_mem_new(priv);
+	if (!mem) {
+		vb2_vmalloc_memops.put(priv);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/* vb2_vmalloc ignores gfp_flags, so the pages are counted but not charged */
+	mem->owner = dev_get_drvdata(dev);
+	ffe_mem_reap(mem->owner, false);
+	mem->size = size;
+	ffe_mem_account(mem->owner, FFE_MEM_BUFFERS, size);
+	return mem;
 }
 
-static int ffe_thread(void *data)
+static void ffe_mem_put(void *buf_priv)
 {
-	struct dev_data *dev = data;
+	struct ffe_mem *mem = buf_priv;
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	set_freezable();
+	if (mem->owner && vb2_vmalloc_memops.num_users(mem->priv) > 1) {
+		spin_lock(&mem->owner->exports_lock);
+		list_add_tail(&mem->node, &mem->owner->exports);
+		spin_unlock(&mem->owner->exports_lock);
+		return;
+	}
+	if (mem->owner)
+		ffe_mem_account(mem->owner, FFE_MEM_BUFFERS, -(long)mem->size);
+	vb2_vmalloc_memops.put(mem->priv);
+	kfree(mem);
+}
 
-	while (1) {
-		ffe_sleep(dev);
-		if (kthread_should_stop())
-			break;
+static void *ffe_mem_get_userptr(struct device *dev, unsigned long vaddr, unsigned long size,
+				 enum dma_data_direction dma_dir)
+{
+	void *priv = vb2_vmalloc_memops.get_userptr(dev, vaddr, size, dma_dir);
+	struct ffe_mem *mem;
+
+	if (IS_ERR_OR_NULL(priv))
+		return priv;
+	mem = ffe_mem_new(priv);
+	if (!mem) {
+		vb2_vmalloc_memops.put_userptr(priv);
+		return ERR_PTR(-ENOMEM);
 	}
-	v4l2_info(&dev->v4l2_dev, "%s: exit\n", __func__);
-	return 0;
+	return mem;
 }
 
-static int ffe_start_generating(struct dev_data *dev)
+static void ffe_mem_put_userptr(void *buf_priv)
 {
-	struct ffe_dmaq *q = &dev->vidq;
+	struct ffe_mem *mem = buf_priv;
+
+	vb2_vmalloc_memops.put_userptr(mem->priv);
+	kfree(mem);
+}
+
+/*
+ * Imported dma-bufs. vb2 maps a DMABUF buffer on every QBUF and unmaps it on
+ * DQBUF, and vb2_vmalloc would vmap and vunmap the whole buffer each time.
+ * Instead each dma-buf is mapped once and the mapping kept, with a reference
+ * on the dma-buf, for as long as the device streams. A dma-buf queued at
+ * another index, or by another handle, finds its mapping here too. At most
+ * FFE_IMPORT_MAX unused imports are kept.
+ */
+#define FFE_IMPORT_MAX			VB2_MAX_FRAME
+
+struct ffe_import {
+	struct list_head		node;			/* on dev_data.imports */
+	struct dev_data			*dev;
+	struct dma_buf			*dbuf;			/* referenced */
+	void				*vaddr;			/* dma_buf_vmap(), on first map */
+	unsigned int			users;			/* buffers attached to it */
+};
+
+static void ffe_import_release(struct ffe_import *imp)
+{
+	if (imp->vaddr)
+		dma_buf_vunmap(imp->dbuf, imp->vaddr);
+	dma_buf_put(imp->dbuf);
+	list_del(&imp->node);
+	imp->dev->n_imports--;
+	kfree(imp);
+}
+
+/* drop unused imports, all of them or those past FFE_IMPORT_MAX; import_lock held */
+static void ffe_import_trim(struct dev_data *dev, bool all)
+{
+	struct ffe_import *imp, *tmp;
+	unsigned int idle = 0;
+
+	list_for_each_entry_safe(imp, tmp, &dev->imports, node) {
+		if (imp->users)
+			continue;
+		if (all || ++idle > FFE_IMPORT_MAX)
+			ffe_import_release(imp);
+	}
+}
+
+static void ffe_import_flush(struct dev_data *dev)
+{
+	mutex_lock(&dev->import_lock);
+	ffe_import_trim(dev, true);
+	mutex_unlock(&dev->import_lock);
+}
+
+static void *ffe_mem_attach_dmabuf(struct device *dev, struct dma_buf *dbuf, unsigned long size,
+				   enum dma_data_direction dma_dir)
+{
+	struct dev_data *owner = dev_get_drvdata(dev);
+	struct ffe_import *imp;
+	struct ffe_mem *mem;
+
+	if (dbuf->size < size)
+		return ERR_PTR(-EFAULT);
+	mem = ffe_mem_new(NULL);
+	if (!mem)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_lock(&owner->import_lock);
+	list_for_each_entry(imp, &owner->imports, node)
+		if (imp->dbuf == dbuf)
+			goto found;
+
+	imp = kzalloc(sizeof(*imp), GFP_KERNEL_ACCOUNT);
+	if (!imp) {
+		mutex_unlock(&owner->import_lock);
+		kfree(mem);
+		return ERR_PTR(-ENOMEM);
+	}
+	imp->dev = owner;
+	imp->dbuf = dbuf;
+	get_dma_buf(dbuf);
+	list_add(&imp->node, &owner->imports);
+	owner->n_imports++;
+found:
+	imp->users++;
+	list_move(&imp->node, &owner->imports);
+	mutex_unlock(&owner->import_lock);
+
+	mem->import = imp;
+	mem->size = size;
+	return mem;
+}
+
+static void ffe_mem_detach_dmabuf(void *buf_priv)
+{
+	struct ffe_mem *mem = buf_priv;
+	struct ffe_import *imp = mem->import;
+	struct dev_data *dev = imp->dev;
+
+	/*
+	 * The mapping stays for the next QBUF of the same dma-buf. Buffers are
+	 * detached after stop_streaming when a queue is freed or closed, so an
+	 * idle device drops its unused imports here.
+	 */
+	mutex_lock(&dev->import_lock);
+	imp->users--;
+	ffe_import_trim(dev, !READ_ONCE(dev->streaming));
+	mutex_unlock(&dev->import_lock);
+	kfree(mem);
+}
+
+static int ffe_mem_map_dmabuf(void *buf_priv)
+{
+	struct ffe_mem *mem = buf_priv;
+	struct ffe_import *imp = mem->import;
+	struct dev_data *dev = imp->dev;
+	int ret = 0;
+
+	mutex_lock(&dev->import_lock);
+	if (imp->vaddr) {
+		dev->import_hits++;
+	} else {
+		imp->vaddr = dma_buf_vmap(imp->dbuf);
+		if (imp->vaddr)
+			dev->import_maps++;
+		else
+			ret = -EFAULT;
+	}
+	mutex_unlock(&dev->import_lock);
+	return ret;
+}
+
+/* kept mapped, see ffe_import */
+static void ffe_mem_unmap_dmabuf(void *buf_priv)
+{
+}
+
+static struct dma_buf *ffe_mem_get_dmabuf(void *buf_priv, unsigned long flags)
+{
+	struct ffe_mem *mem = buf_priv;
+
+	return vb2_vmalloc_memops.get_dmabuf(mem->priv, flags);
+}
+
+static void *ffe_mem_vaddr(void *buf_priv)
+{
+	struct ffe_mem *mem = buf_priv;
+
+	if (mem->import)
+		return mem->import->vaddr;
+	return vb2_vmalloc_memops.vaddr(mem->priv);
+}
+
+static unsigned int ffe_mem_num_users(void *buf_priv)
+{
+	struct ffe_mem *mem = buf_priv;
+
+	if (mem->import)
+		return 1;
+	return vb2_vmalloc_memops.num_users(mem->priv);
+}
+
+static int ffe_mem_mmap(void *buf_priv, struct vm_area_struct *vma)
+{
+	struct ffe_mem *mem = buf_priv;
+
+	return vb2_vmalloc_memops.mmap(mem->priv, vma);
+}
+
+static const struct vb2_mem_ops ffe_memops = {
+	.alloc				= ffe_mem_alloc,
+	.put				= ffe_mem_put,
+	.get_dmabuf			= ffe_mem_get_dmabuf,
+	.get_userptr			= ffe_mem_get_userptr,
+	.put_userptr			= ffe_mem_put_userptr,
+	.attach_dmabuf			= ffe_mem_attach_dmabuf,
+	.detach_dmabuf			= ffe_mem_detach_dmabuf,
+	.map_dmabuf			= ffe_mem_map_dmabuf,
+	.unmap_dmabuf			= ffe_mem_unmap_dmabuf,
+	.vaddr				= ffe_mem_vaddr,
+	.num_users			= ffe_mem_num_users,
+	.mmap				= ffe_mem_mmap,
+};
+
+/*
+ * File source. A raw clip of src_width x src_height frames in one of the
+ * formats[] layouts is loaded into memory and played back on the frame
+ * clock in place of the pattern. When the negotiated format differs the
+ * frame is converted at fill time into a small cache, so a clip that fits
+ * in the cache is converted once however often it loops.
+ */
+static void ffe_source_flush(struct dev_data *dev)
+{
+	struct ffe_source *src = &dev->src;
+	size_t frame;
+	int i;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	for (i = 0; i < FFE_SRC_CACHE_MAX; i++) {
+		kvfree(src->cache[i].buf);
+		src->cache[i].buf = NULL;
+		src->cache[i].frame = -1;
+	}
+	ffe_mem_account(dev, FFE_MEM_SOURCE, -(long)src->cache_bytes);
+	src->cache_bytes = 0;
+
+	frame = ffe_image_size(dev->fmt, dev->width, dev->height);
+	src->n_slots = clamp_t(size_t, ((size_t)READ_ONCE(src_cache_mb) << 20) / frame, 1, FFE_SRC_CACHE_MAX);
+	src->hits = 0;
+	src->misses = 0;
+	src->evictions = 0;
+	src->convert_ns = 0;
+	src->lz4_ns = 0;
+	src->lz4_bytes = 0;
+	src->mismatch = false;
+}
+
+/* Source memory is allocated for the opener that set it up, and charged to it */
+static void *ffe_source_alloc(struct ffe_source *src, size_t size, gfp_t gfp)
+{
+	void *p = kvmalloc(size, gfp | GFP_KERNEL_ACCOUNT);
+
+	if (p) {
+		src->charged += size;
+		ffe_mem_account(container_of(src, struct dev_data, src), FFE_MEM_SOURCE, size);
+	}
+	return p;
+}
+
+static void ffe_source_release(struct ffe_source *src)
+{
+	unsigned int i;
+
+	if (src->filp) {
+		cancel_work_sync(&src->ra_work);
+		for (i = 0; i < src->ra_size; i++) {
+			kvfree(src->ring[i].buf);
+			src->ring[i].buf = NULL;
+		}
+		filp_close(src->filp, NULL);
+		src->filp = NULL;
+		src->ra_size = 0;
+	}
+	for (i = 0; src->frames && i < src->n_frames; i++)
+		kvfree(src->frames[i].data);
+	kvfree(src->frames);
+	src->frames = NULL;
+	src->n_frames = 0;
+	src->stored = 0;
+	kvfree(src->stage);
+	src->stage = NULL;
+	ffe_mem_account(container_of(src, struct dev_data, src), FFE_MEM_SOURCE, -(long)src->charged);
+	src->charged = 0;
+}
+
+/*
+ * Streaming file source. Instead of loading the clip, a ring of raw frames
+ * is kept filled by a work item reading the frames for the next ticks of the
+ * frame clock. The generator never waits for it: when the frame for a tick
+ * is not in yet, the last delivered frame is repeated and a miss counted.
+ * The ring has one slot more than the window so the repeated frame is never
+ * the one being read into.
+ */
+static void ffe_readahead_work(struct work_struct *work)
+{
+	struct dev_data *dev = container_of(work, struct dev_data, src.ra_work);
+	struct ffe_source *src = &dev->src;
+	struct ffe_ra_slot *slot;
+	unsigned int tick, i, idx;
+	size_t got;
+	loff_t pos;
+	ssize_t n;
+
+	for (;;) {
+		spin_lock(&src->ra_lock);
+		for (i = 0; i + 1 < src->ra_size; i++) {
+			tick = src->ra_want + i;
+			idx = tick % src->ra_size;
+			slot = &src->ring[idx];
+			if (idx == src->ra_pinned || !(slot->ready && slot->tick == tick))
+				break;
+		}
+		if (i + 1 >= src->ra_size || idx == src->ra_pinned) {
+			spin_unlock(&src->ra_lock);
+			return;
+		}
+		slot->ready = false;
+		slot->tick = tick;
+		spin_unlock(&src->ra_lock);
+
+		pos = (loff_t)(tick % src->n_frames) * src->frame_size;
+		for (got = 0; got < src->frame_size; got += n) {
+			n = kernel_read(src->filp, slot->buf + got, src->frame_size - got, &pos);
+			if (n <= 0) {
+				if (!src->ra_errors++)
+					v4l2_err(&dev->v4l2_dev, "%s: read of frame %u failed (%zd)..\n",
+						 __func__, tick % src->n_frames, n);
+				return;
+			}
+		}
+
+		spin_lock(&src->ra_lock);
+		slot->ready = slot->tick == tick;
+		spin_unlock(&src->ra_lock);
+	}
+}
+
+static int ffe_source_stream(struct ffe_source *src, struct file *filp, unsigned int n_frames, unsigned int window)
+{
+	unsigned int i;
+
+	src->ra_size = min_t(unsigned int, window, FFE_SRC_RA_MAX) + 1;
+	for (i = 0; i < src->ra_size; i++) {
+		src->ring[i].buf = ffe_source_alloc(src, src->frame_size, 0);
+		src->ring[i].ready = false;
+		if (!src->ring[i].buf)
+			return -ENOMEM;
+	}
+
+	src->filp = filp;
+	src->n_frames = n_frames;
+	src->ra_want = 0;
+	src->ra_pinned = -1;
+	src->ra_hits = 0;
+	src->ra_misses = 0;
+	src->ra_errors = 0;
+	queue_work(system_unbound_wq, &src->ra_work);
+	return 0;
+}
+
+/* Restart the readahead window at the first tick of a new stream */
+static void ffe_source_rewind(struct dev_data *dev)
+{
+	struct ffe_source *src = &dev->src;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (!src->filp)
+		return;
+
+	spin_lock(&src->ra_lock);
+	src->ra_want = dev->f_count;
+	src->ra_pinned = -1;
+	src->ra_hits = 0;
+	src->ra_misses = 0;
+	spin_unlock(&src->ra_lock);
+	queue_work(system_unbound_wq, &src->ra_work);
+}
+
+/* Keep the frame in src->stage compressed unless LZ4 fails to shrink it */
+static int ffe_source_store(struct ffe_source *src, struct ffe_src_frame *f, void *wrkmem, u8 *packed)
+{
+	const u8 *from = src->stage;
+	int len = 0;
+
+	if (wrkmem)
+		len = LZ4_compress_default((const char *)src->stage, (char *)packed, src->frame_size,
+					   LZ4_compressBound(src->frame_size), wrkmem);
+	if (len > 0 && len < src->frame_size)
+		from = packed;
+	else
+		len = src->frame_size;
+
+	f->data = ffe_source_alloc(src, len, 0);
+	if (!f->data)
+		return -ENOMEM;
+	memcpy(f->data, from, len);
+	f->len = len;
+	src->stored += len;
+	return 0;
+}
+
+static int ffe_source_load(struct dev_data *dev)
+{
+	struct ffe_source *src = &dev->src;
+	unsigned int max_frames;
+	void *wrkmem = NULL;
+	u8 *packed = NULL;
+	struct file *filp;
+	loff_t pos = 0;
+	bool lz4;
+	u64 limit;
+	ssize_t n;
+	size_t got;
+	int ret = 0;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	src->stale = false;
+	ffe_source_release(src);
+	if (!src->path[0])
+		return 0;
+
+	if (!src->scratch) {
+		src->scratch = ffe_pattern_alloc(dev, MAX_WIDTH * 4);
+		if (!src->scratch)
+			return -ENOMEM;
+	}
+
+	filp = filp_open(src->path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+
+	src->frame_size = ffe_image_size(src->fmt, src->width, src->height);
+	max_frames = div_u64(i_size_read(file_inode(filp)), src->frame_size);
+	if (!max_frames) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (READ_ONCE(src_readahead)) {
+		ret = ffe_source_stream(src, filp, max_frames, READ_ONCE(src_readahead));
+		if (ret) {
+			src->filp = filp;
+			ffe_source_release(src);
+			return ret;
+		}
+		v4l2_info(&dev->v4l2_dev, "%s: %s, streaming %u frames of %ux%u %s, %u read ahead\n", __func__,
+			  src->path, src->n_frames, src->width, src->height, src->fmt->name, src->ra_size - 1);
+		return 0;
+	}
+
+	/*
+	 * No more frames than the store can hold, so a long file of small
+	 * frames does not size the index. LZ4 cannot pack a frame below about
+	 * 1/255 of its size.
+	 */
+	lz4 = READ_ONCE(src_lz4);
+	limit = (u64)READ_ONCE(src_max_mb) << 20;
+	max_frames = min_t(u64, max_frames, div_u64(limit, lz4 ? DIV_ROUND_UP(src->frame_size, 255) : src->frame_size));
+	if (!max_frames) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	src->frames = ffe_source_alloc(src, max_frames * sizeof(*src->frames), __GFP_ZERO);
+	src->stage = ffe_source_alloc(src, src->frame_size, 0);
+	if (lz4) {
+		wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL_ACCOUNT);
+		packed = kvmalloc(LZ4_compressBound(src->frame_size), GFP_KERNEL_ACCOUNT);
+		if (!wrkmem || !packed)
+			ret = -ENOMEM;
+	}
+	if (!src->frames || !src->stage || ret) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* read a frame at a time, stopping before the store could pass src_max_mb */
+	while (src->n_frames < max_frames && src->stored + src->frame_size <= limit) {
+		for (got = 0; got < src->frame_size; got += n) {
+			n = kernel_read(filp, src->stage + got, src->frame_size - got, &pos);
+			if (n <= 0) {
+				ret = n ? n : -EIO;
+				goto out;
+			}
+		}
+
+		ret = ffe_source_store(src, &src->frames[src->n_frames], wrkmem, packed);
+		if (ret)
+			goto out;
+		src->n_frames++;
+		cond_resched();
+	}
+
+out:
+	filp_close(filp, NULL);
+	kvfree(packed);
+	kvfree(wrkmem);
+	if (ret || !src->n_frames) {
+		ffe_source_release(src);
+		return ret ? : -EINVAL;
+	}
+
+	v4l2_info(&dev->v4l2_dev, "%s: %s, %u frames of %ux%u %s, %llu KiB stored\n", __func__, src->path,
+		  src->n_frames, src->width, src->height, src->fmt->name, src->stored >> 10);
+	return 0;
+}
+
+static void ffe_source_free(struct dev_data *dev)
+{
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	ffe_source_flush(dev);
+	ffe_source_release(&dev->src);
+}
+
+/* Byte order of the Y'CbCr samples inside one 4:2:2 macropixel */
+struct ffe_yuv_layout {
+	u8				y0, u, y1, v;
+};
+
+static const struct ffe_yuv_layout *ffe_yuv_layout(u32 fourcc)
+{
+	static const struct ffe_yuv_layout yuyv = { 0, 1, 2, 3 };
+	static const struct ffe_yuv_layout uyvy = { 1, 0, 3, 2 };
+	static const struct ffe_yuv_layout yvyu = { 0, 3, 2, 1 };
+	static const struct ffe_yuv_layout vyuy = { 1, 2, 3, 0 };
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_UYVY:
+		return &uyvy;
+	case V4L2_PIX_FMT_YVYU:
+		return &yvyu;
+	case V4L2_PIX_FMT_VYUY:
+		return &vyuy;
+	default:
+		return &yuyv;
+	}
+}
+
+/*
+ * Word-at-a-time byte swaps for the conversions that are a pure reordering:
+ * YUYV <-> UYVY, YVYU <-> VYUY and the LE/BE variants of RGB565/RGB555 swap
+ * each byte pair, RGB32 <-> BGR32 reverses each 4-byte pixel.
+ */
+static void ffe_swab16_row(u8 *dst, const u8 *src, size_t len)
+{
+	size_t i;
+	u64 x;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		x = get_unaligned((const u64 *)(src + i));
+		x = ((x & 0x00ff00ff00ff00ffULL) << 8) | ((x >> 8) & 0x00ff00ff00ff00ffULL);
+		put_unaligned(x, (u64 *)(dst + i));
+	}
+	for (; i + 2 <= len; i += 2) {
+		dst[i] = src[i + 1];
+		dst[i + 1] = src[i];
+	}
+}
+
+static void ffe_swab32_row(u8 *dst, const u8 *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4)
+		put_unaligned(swab32(get_unaligned((const u32 *)(src + i))), (u32 *)(dst + i));
+}
+
+static void ffe_yuv_row(u8 *dst, const u8 *src, unsigned int width, u32 from, u32 to)
+{
+	const struct ffe_yuv_layout *s = ffe_yuv_layout(from);
+	const struct ffe_yuv_layout *d = ffe_yuv_layout(to);
+	unsigned int i;
+
+	if (d->y0 == (s->y0 ^ 1) && d->u == (s->u ^ 1) && d->v == (s->v ^ 1)) {
+		ffe_swab16_row(dst, src, width * 2);
+		return;
+	}
+
+	for (i = 0; i + 1 < width; i += 2, src += 4, dst += 4) {
+		dst[d->y0] = src[s->y0];
+		dst[d->u] = src[s->u];
+		dst[d->y1] = src[s->y1];
+		dst[d->v] = src[s->v];
+	}
+}
+
+/* Unpack one row to 8-bit R, G, B triplets, replicating the high bits of 5/6-bit fields */
+static void ffe_unpack_rgb_row(u8 *rgb, const u8 *src, unsigned int width, u32 fourcc)
+{
+	unsigned int i;
+	u16 p;
+
+	for (i = 0; i < width; i++, rgb += 3) {
+		switch (fourcc) {
+		case V4L2_PIX_FMT_RGB565:
+		case V4L2_PIX_FMT_RGB565X:
+			p = fourcc == V4L2_PIX_FMT_RGB565 ? src[0] | src[1] << 8 : src[0] << 8 | src[1];
+			rgb[0] = ((p >> 8) & 0xf8) | (p >> 13);
+			rgb[1] = ((p >> 3) & 0xfc) | ((p >> 9) & 0x03);
+			rgb[2] = ((p << 3) & 0xf8) | ((p >> 2) & 0x07);
+			src += 2;
+			break;
+		case V4L2_PIX_FMT_RGB555:
+		case V4L2_PIX_FMT_RGB555X:
+			p = fourcc == V4L2_PIX_FMT_RGB555 ? src[0] | src[1] << 8 : src[0] << 8 | src[1];
+			rgb[0] = ((p >> 7) & 0xf8) | ((p >> 12) & 0x07);
+			rgb[1] = ((p >> 2) & 0xf8) | ((p >> 7) & 0x07);
+			rgb[2] = ((p << 3) & 0xf8) | ((p >> 2) & 0x07);
+			src += 2;
+			break;
+		case V4L2_PIX_FMT_RGB24:
+			rgb[0] = src[0];
+			rgb[1] = src[1];
+			rgb[2] = src[2];
+			src += 3;
+			break;
+		case V4L2_PIX_FMT_BGR24:
+			rgb[0] = src[2];
+			rgb[1] = src[1];
+			rgb[2] = src[0];
+			src += 3;
+			break;
+		case V4L2_PIX_FMT_RGB32:
+			rgb[0] = src[1];
+			rgb[1] = src[2];
+			rgb[2] = src[3];
+			src += 4;
+			break;
+		case V4L2_PIX_FMT_BGR32:
+			rgb[0] = src[2];
+			rgb[1] = src[1];
+			rgb[2] = src[0];
+			src += 4;
+			break;
+		}
+	}
+}
+
+/* Pack 8-bit triplets the way generate_color_pix() lays out each format */
+static void ffe_pack_rgb_row(u8 *dst, const u8 *rgb, unsigned int width, u32 fourcc, u8 alpha)
+{
+	unsigned int i;
+	u8 r, g, b;
+
+	for (i = 0; i < width; i++, rgb += 3) {
+		r = rgb[0];
+		g = rgb[1];
+		b = rgb[2];
+		switch (fourcc) {
+		case V4L2_PIX_FMT_RGB565:
+		case V4L2_PIX_FMT_RGB565X:
+			r >>= 3;
+			g >>= 2;
+			b >>= 3;
+			dst[fourcc == V4L2_PIX_FMT_RGB565X] = (g << 5) | b;
+			dst[fourcc == V4L2_PIX_FMT_RGB565] = (r << 3) | (g >> 3);
+			dst += 2;
+			break;
+		case V4L2_PIX_FMT_RGB555:
+		case V4L2_PIX_FMT_RGB555X:
+			r >>= 3;
+			g >>= 3;
+			b >>= 3;
+			dst[fourcc == V4L2_PIX_FMT_RGB555X] = (g << 5) | b;
+			dst[fourcc == V4L2_PIX_FMT_RGB555] = (alpha & 0x80) | (r << 2) | (g >> 3);
+			dst += 2;
+			break;
+		case V4L2_PIX_FMT_RGB24:
+			dst[0] = r;
+			dst[1] = g;
+			dst[2] = b;
+			dst += 3;
+			break;
+		case V4L2_PIX_FMT_BGR24:
+			dst[0] = b;
+			dst[1] = g;
+			dst[2] = r;
+			dst += 3;
+			break;
+		case V4L2_PIX_FMT_RGB32:
+			dst[0] = alpha;
+			dst[1] = r;
+			dst[2] = g;
+			dst[3] = b;
+			dst += 4;
+			break;
+		case V4L2_PIX_FMT_BGR32:
+			dst[0] = b;
+			dst[1] = g;
+			dst[2] = r;
+			dst[3] = alpha;
+			dst += 4;
+			break;
+		}
+	}
+}
+
+/* 4:4:4 triplets to one 4:2:2 row, chroma averaged over each pixel pair */
+static void ffe_rgb_to_yuv_row(const struct ffe_csc *csc, u8 *dst, const u8 *rgb, unsigned int width, u32 fourcc)
+{
+	const struct ffe_yuv_layout *d = ffe_yuv_layout(fourcc);
+	unsigned int i;
+	u8 p0[3], p1[3];
+
+	for (i = 0; i + 1 < width; i += 2, rgb += 6, dst += 4) {
+		ffe_rgb_to_ycbcr(csc, rgb[0], rgb[1], rgb[2], p0);
+		ffe_rgb_to_ycbcr(csc, rgb[3], rgb[4], rgb[5], p1);
+		dst[d->y0] = p0[0];
+		dst[d->y1] = p1[0];
+		dst[d->u] = (p0[1] + p1[1] + 1) >> 1;
+		dst[d->v] = (p0[2] + p1[2] + 1) >> 1;
+	}
+}
+
+static void ffe_yuv_to_rgb_row(const struct ffe_csc *csc, u8 *rgb, const u8 *src, unsigned int width, u32 fourcc)
+{
+	const struct ffe_yuv_layout *s = ffe_yuv_layout(fourcc);
+	unsigned int i;
+
+	for (i = 0; i + 1 < width; i += 2, src += 4, rgb += 6) {
+		ffe_ycbcr_to_rgb(csc, src[s->y0], src[s->u], src[s->v], rgb);
+		ffe_ycbcr_to_rgb(csc, src[s->y1], src[s->u], src[s->v], rgb + 3);
+	}
+}
+
+static void ffe_convert_frame(struct dev_data *dev, u8 *dst, const u8 *src)
+{
+	const struct ffe_fmt *from = dev->src.fmt, *to = dev->fmt;
+	unsigned int width = dev->width, row;
+	size_t in = width * (from->depth / 8), out = width * dev->pixelsize;
+	u8 *rgb = dev->src.scratch;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	for (row = 0; row < dev->height; row++, src += in, dst += out) {
+		if (from->is_yuv && to->is_yuv) {
+			ffe_yuv_row(dst, src, width, from->fourcc, to->fourcc);
+			continue;
+		}
+
+		if (from->depth == 16 && to->depth == 16 && !from->is_yuv && !to->is_yuv &&
+		    (from->fourcc == V4L2_PIX_FMT_RGB565 || from->fourcc == V4L2_PIX_FMT_RGB565X) ==
+		    (to->fourcc == V4L2_PIX_FMT_RGB565 || to->fourcc == V4L2_PIX_FMT_RGB565X)) {
+			ffe_swab16_row(dst, src, out);
+			continue;
+		}
+
+		if (from->depth == 32 && to->depth == 32) {
+			ffe_swab32_row(dst, src, out);
+			continue;
+		}
+
+		if (from->is_yuv)
+			ffe_yuv_to_rgb_row(&dev->src.csc, rgb, src, width, from->fourcc);
+		else
+			ffe_unpack_rgb_row(rgb, src, width, from->fourcc);
+
+		if (to->is_yuv)
+			ffe_rgb_to_yuv_row(&dev->csc, dst, rgb, width, to->fourcc);
+		else
+			ffe_pack_rgb_row(dst, rgb, width, to->fourcc, dev->alpha);
+	}
+}
+
+/* Raw frame into dst, decompressing when it was stored with LZ4 */
+static int ffe_source_read(struct dev_data *dev, unsigned int frame, u8 *dst, bool zero)
+{
+	struct ffe_source *src = &dev->src;
+	const struct ffe_src_frame *f = &src->frames[frame];
+	u64 start_ns;
+	int n;
+
+	if (f->len == src->frame_size) {
+		ffe_copy(dst, f->data, f->len, zero);
+		return 0;
+	}
+
+	start_ns = ktime_get_ns();
+	n = LZ4_decompress_safe((const char *)f->data, (char *)dst, f->len, src->frame_size);
+	src->lz4_ns += ktime_get_ns() - start_ns;
+	if (n != src->frame_size) {
+		v4l2_err(&dev->v4l2_dev, "%s: frame %u is corrupt (%d)..\n", __func__, frame, n);
+		return -EIO;
+	}
+	src->lz4_bytes += n;
+	return 0;
+}
+
+static bool ffe_source_fill_stream(struct dev_data *dev, u8 *vbuf, bool zero)
+{
+	struct ffe_source *src = &dev->src;
+	unsigned int tick = dev->f_count;
+	struct ffe_ra_slot *slot;
+	u64 start_ns;
+	int idx;
+
+	spin_lock(&src->ra_lock);
+	idx = tick % src->ra_size;
+	slot = &src->ring[idx];
+	if (slot->ready && slot->tick == tick) {
+		src->ra_pinned = idx;
+		src->ra_hits++;
+	} else {
+		idx = src->ra_pinned;
+		src->ra_misses++;
+	}
+	src->ra_want = tick + 1;
+	spin_unlock(&src->ra_lock);
+	queue_work(system_unbound_wq, &src->ra_work);
+
+	if (idx < 0)
+		return false;
+
+	slot = &src->ring[idx];
+	if (src->fmt == dev->fmt) {
+		ffe_copy(vbuf, slot->buf, src->frame_size, zero);
+		return true;
+	}
+
+	start_ns = ktime_get_ns();
+	ffe_convert_frame(dev, vbuf, slot->buf);
+	src->convert_ns += ktime_get_ns() - start_ns;
+	return true;
+}
+
+/* An empty slot if there is one, else the least recently used */
+static struct ffe_src_slot *ffe_source_victim(struct ffe_source *src, unsigned int n)
+{
+	struct ffe_src_slot *victim = &src->cache[0];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (src->cache[i].frame == -1)
+			return &src->cache[i];
+		if ((int)(src->cache[i].used - victim->used) < 0)
+			victim = &src->cache[i];
+	}
+	return victim;
+}
+
+/*
+ * Fill vbuf with the source frame for this tick in the negotiated format, or
+ * return false to fall back to the pattern. Playback follows the frame clock,
+ * so frames dropped for want of a buffer are skipped in the clip too. In the
+ * clip's own format the frame is decompressed straight into the buffer.
+ */
+static bool ffe_source_fill(struct dev_data *dev, u8 *vbuf, bool zero)
+{
+	struct ffe_source *src = &dev->src;
+	size_t size = ffe_image_size(dev->fmt, dev->width, dev->height);
+	struct ffe_src_slot *slot;
+	unsigned int frame, i;
+	u64 start_ns;
+
+	if (!src->n_frames)
+		return false;
+
+	if (src->width != dev->width || src->height != dev->height) {
+		if (!src->mismatch)
+			v4l2_err(&dev->v4l2_dev, "%s: source is %ux%u, format is %ux%u, using the pattern..\n",
+				 __func__, src->width, src->height, dev->width, dev->height);
+		src->mismatch = true;
+		return false;
+	}
+
+	/* depth, IR and tiled frames are only played in their own format */
+	if (src->fmt != dev->fmt && (!ffe_fmt_packed(src->fmt) || !ffe_fmt_packed(dev->fmt))) {
+		if (!src->mismatch)
+			v4l2_err(&dev->v4l2_dev, "%s: cannot convert %s to %s, using the pattern..\n",
+				 __func__, src->fmt->name, dev->fmt->name);
+		src->mismatch = true;
+		return false;
+	}
+
+	if (src->filp)
+		return ffe_source_fill_stream(dev, vbuf, zero);
+
+	frame = dev->f_count % src->n_frames;
+	if (src->fmt == dev->fmt)
+		return !ffe_source_read(dev, frame, vbuf, zero);
+
+	for (i = 0; i < src->n_slots; i++) {
+		if (src->cache[i].frame == frame) {
+			src->hits++;
+			src->cache[i].used = dev->f_count;
+			ffe_copy(vbuf, src->cache[i].buf, size, zero);
+			return true;
+		}
+	}
+
+	src->misses++;
+	slot = ffe_source_victim(src, src->n_slots);
+	if (slot->frame != -1)
+		src->evictions++;
+	slot->frame = -1;
+	slot->used = dev->f_count;
+	if (!slot->buf) {
+		/* filled from the generator thread, which has no memcg to charge */
+		slot->buf = kvmalloc(size, GFP_KERNEL);
+		if (!slot->buf)
+			return false;
+		src->cache_bytes += size;
+		ffe_mem_account(dev, FFE_MEM_SOURCE, size);
+	}
+
+	if (ffe_source_read(dev, frame, src->stage, true))
+		return false;
+
+	start_ns = ktime_get_ns();
+	ffe_convert_frame(dev, slot->buf, src->stage);
+	src->convert_ns += ktime_get_ns() - start_ns;
+	slot->frame = frame;
+	ffe_copy(vbuf, slot->buf, size, zero);
+	return true;
+}
+
+/* Apply the gain of exposure e to width pixels in the negotiated format */
+static void ffe_hdr_row(struct dev_data *dev, unsigned int e, u8 *row, unsigned int width)
+{
+	const u8 *lut = dev->hdr.lut[e];
+	const u8 *clut = dev->hdr.clut[e];
+	u32 fourcc = dev->fmt->fourcc;
+	const struct ffe_yuv_layout *l;
+	unsigned int i, k, n;
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_VYUY:
+		l = ffe_yuv_layout(fourcc);
+		for (i = 0; i + 1 < width; i += 2, row += 4) {
+			row[l->y0] = lut[row[l->y0]];
+			row[l->y1] = lut[row[l->y1]];
+			row[l->u] = clut[row[l->u]];
+			row[l->v] = clut[row[l->v]];
+		}
+		break;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		for (i = 0; i < width * 3; i++)
+			row[i] = lut[row[i]];
+		break;
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+		/* leave the alpha byte alone */
+		row += fourcc == V4L2_PIX_FMT_RGB32;
+		for (i = 0; i < width; i++, row += 4) {
+			row[0] = lut[row[0]];
+			row[1] = lut[row[1]];
+			row[2] = lut[row[2]];
+		}
+		break;
+	default:
+		/* 16-bit RGB, through 8-bit triplets */
+		for (i = 0; i < width; i += n) {
+			n = min(width - i, (unsigned int)MAX_WIDTH);
+			ffe_unpack_rgb_row(dev->hdr.rgb, row + i * 2, n, fourcc);
+			for (k = 0; k < n * 3; k++)
+				dev->hdr.rgb[k] = lut[dev->hdr.rgb[k]];
+			ffe_pack_rgb_row(row + i * 2, dev->hdr.rgb, n, fourcc, dev->alpha);
+		}
+		break;
+	}
+}
+
+/*
+ * Build the gain LUTs and the pattern line of every exposure. Luma is scaled
+ * above black and clipped at white of the quantization range, chroma is
+ * scaled towards grey for the short exposures only.
+ */
+static int ffe_hdr_build(struct dev_data *dev)
+{
+	struct ffe_hdr *hdr = &dev->hdr;
+	bool full = !dev->fmt->is_yuv || dev->quantization == V4L2_QUANTIZATION_FULL_RANGE;
+	int black = full ? 0 : 16, white = full ? 255 : 235, cmax = full ? 255 : 240;
+	unsigned int e, i, len;
+	int gain, cgain;
+
+	if (hdr->exposures <= 1)
+		return 0;
+
+	if (!hdr->rgb) {
+		hdr->rgb = ffe_pattern_alloc(dev, MAX_WIDTH * 3);
+		if (!hdr->rgb)
+			return -ENOMEM;
+	}
+
+	len = dev->width * 2 * dev->pixelsize;
+	for (e = 0; e < hdr->exposures; e++) {
+		gain = hdr_gains[hdr->exposures - 1][e];
+		cgain = min(gain, 256);
+		for (i = 0; i < 256; i++) {
+			hdr->lut[e][i] = clamp(black + ((max_t(int, i, black) - black) * gain + 128) / 256, black, white);
+			hdr->clut[e][i] = clamp(128 + ((int)i - 128) * cgain / 256, 256 - cmax, cmax);
+		}
+
+		if (!hdr->line[e]) {
+			hdr->line[e] = ffe_pattern_alloc(dev, MAX_WIDTH * 8);
+			if (!hdr->line[e])
+				return -ENOMEM;
+		}
+		memcpy(hdr->line[e], dev->line, len);
+		if (ffe_fmt_packed(dev->fmt))
+			ffe_hdr_row(dev, e, hdr->line[e], dev->width * 2);
+	}
+	return 0;
+}
+
+/*
+ * The pattern line is built on first open or S_FMT rather than at probe or
+ * in every buffer_prepare(), so registering many devices stays cheap and the
+ * first QBUF does not pay for it.
+ */
+static int ffe_prepare_pattern(struct dev_data *dev)
+{
+	int ret;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (dev->pattern_valid)
+		return 0;
+
+	if (!dev->line) {
+		dev->line = ffe_pattern_alloc(dev, MAX_WIDTH * 8);
+		if (!dev->line)
+			return -ENOMEM;
+	}
+
+	if (dev->fmt->tile_w && !dev->tile_uv) {
+		dev->tile_uv = ffe_pattern_alloc(dev, MAX_WIDTH * 2);
+		if (!dev->tile_uv)
+			return -ENOMEM;
+	}
+
+	if (dev->fmt->is_depth && !dev->depth.row) {
+		dev->depth.row = ffe_pattern_alloc(dev, MAX_WIDTH * sizeof(__le16));
+		if (!dev->depth.row)
+			return -ENOMEM;
+	}
+
+	/* an in-flight frame reads the lines, the atlas and the source store */
+	mutex_lock(&dev->gen_lock);
+	ffe_build_csc(dev);
+	generate_colorbar(dev);
+	ret = ffe_hdr_build(dev);
+	if (!ret)
+		ret = ffe_build_osd_atlas(dev);
+	if (ret)
+		goto out;
+
+	/* converted frames were for the old format */
+	ffe_source_flush(dev);
+	if (dev->src.stale) {
+		ret = ffe_source_load(dev);
+		if (ret)
+			v4l2_err(&dev->v4l2_dev, "%s: cannot load %s (%d), using the pattern..\n", __func__, dev->src.path, ret);
+		ret = 0;
+	}
+
+	dev->pattern_valid = true;
+out:
+	mutex_unlock(&dev->gen_lock);
+	return ret;
+}
+
+static void ffe_fill_rows(u8 *vbuf, const u8 *src, unsigned int size, unsigned int height, bool zero)
+{
+	unsigned int i;
+
+	for (i = 0; i < height; i++)
+		ffe_copy(vbuf + i * size, src, size, zero);
+}
+
+static void ffe_fill_doubling(u8 *vbuf, const u8 *src, unsigned int size, unsigned int height, bool zero)
+{
+	unsigned int block, rows, n, i;
+
+	block = max_t(unsigned int, READ_ONCE(fill_block) * 1024 / size, 1);
+	ffe_copy(vbuf, src, size, zero);
+
+	/* grow the first block by doubling while it stays cache resident */
+	for (rows = 1; rows < block && rows < height; rows += n) {
+		n = min3(rows, block - rows, height - rows);
+		ffe_copy(vbuf + rows * size, vbuf, n * size, zero);
+	}
+
+	/* replicate the hot block down the rest of the frame */
+	for (i = rows; i < height; i += n) {
+		n = min(rows, height - i);
+		ffe_copy(vbuf + i * size, vbuf, n * size, zero);
+	}
+}
+
+/*
+ * Depth ramp kernel: z[i] = (base + i * step) >> 16 in 16.16 millimetres.
+ * Two 32-bit lanes per u64 cannot carry into each other below 64 m, so four
+ * Z16 samples are stored per iteration. z must be 8-byte aligned.
+ */
+static void ffe_depth_ramp(__le16 *z, unsigned int width, u32 base, u32 step)
+{
+	u64 inc = (u64)(4 * step) << 32 | (4 * step);
+	u64 a = (u64)(base + step) << 32 | base;
+	u64 b = a + ((u64)(2 * step) << 32 | (2 * step));
+	unsigned int i;
+
+	for (i = 0; i + 4 <= width; i += 4) {
+		*(__le64 *)(z + i) = cpu_to_le64((a >> 16 & 0xffff) | (a >> 48) << 16 |
+						 (b >> 16 & 0xffff) << 32 | (b >> 48) << 48);
+		a += inc;
+		b += inc;
+	}
+	for (; i < width; i++)
+		z[i] = cpu_to_le16((base + i * step) >> 16);
+}
+
+/* 12-bit IR level of a depth sample */
+static inline unsigned int ffe_depth_ir(__le16 z)
+{
+	unsigned int mm = clamp_t(unsigned int, le16_to_cpu(z), FFE_DEPTH_NEAR, FFE_DEPTH_FAR);
+
+	return (FFE_DEPTH_FAR - mm) * FFE_DEPTH_IR_SCALE >> 16;
+}
+
+static void ffe_depth_pack(struct dev_data *dev, u8 *dst, const __le16 *z, unsigned int width)
+{
+	unsigned int d = READ_ONCE(dev->comp.disparity);
+	unsigned int i, l, r;
+	u32 v;
+
+	switch (dev->fmt->fourcc) {
+	case V4L2_PIX_FMT_Z16:
+		memcpy(dst, z, width * 2);
+		break;
+	case V4L2_PIX_FMT_Y8I:
+		for (i = 0; i < width; i++, dst += 2) {
+			dst[0] = ffe_depth_ir(z[i]) >> 4;
+			dst[1] = ffe_depth_ir(z[min(i + d, width - 1)]) >> 4;
+		}
+		break;
+	case V4L2_PIX_FMT_Y12I:
+		/* left in bits 0-11, right in bits 12-23, little endian */
+		for (i = 0; i < width; i++, dst += 3) {
+			l = ffe_depth_ir(z[i]);
+			r = ffe_depth_ir(z[min(i + d, width - 1)]);
+			v = l | r << 12;
+			dst[0] = v;
+			dst[1] = v >> 8;
+			dst[2] = v >> 16;
+		}
+		break;
+	}
+}
+
+/*
+ * A ramp from near to far across the frame, a plane tilted in both axes, or
+ * an object at the near plane moving across a far wall. A row only gets
+ * rendered when it differs from the one above.
+ */
+static void ffe_fill_depth(struct dev_data *dev, u8 *vbuf, bool zero)
+{
+	unsigned int pattern = READ_ONCE(dev->depth.pattern);
+	unsigned int width = dev->width, height = dev->height;
+	unsigned int stride = width * dev->pixelsize;
+	u32 near = FFE_DEPTH_NEAR << 16, span = (FFE_DEPTH_FAR - FFE_DEPTH_NEAR) << 16;
+	unsigned int bw = (width / 4) & ~3, bh = height / 4;
+	unsigned int bx = (dev->mv_count % (width - bw)) & ~3, by = (height - bh) / 2;
+	__le16 *z = dev->depth.row;
+	bool inside, was = false;
+	unsigned int y;
+	u8 *row;
+
+	for (y = 0; y < height; y++) {
+		row = vbuf + y * stride;
+		switch (pattern) {
+		case FFE_DEPTH_RAMP:
+			if (y) {
+				ffe_copy(row, row - stride, stride, zero);
+				continue;
+			}
+			ffe_depth_ramp(z, width, near, span / width);
+			break;
+		case FFE_DEPTH_PLANE:
+			ffe_depth_ramp(z, width, near + div_u64((u64)span * y, 2 * height), span / width / 2);
+			break;
+		default:
+			inside = y >= by && y < by + bh;
+			if (y && inside == was) {
+				ffe_copy(row, row - stride, stride, zero);
+				continue;
+			}
+			was = inside;
+			ffe_depth_ramp(z, width, FFE_DEPTH_FAR << 16, 0);
+			if (inside)
+				ffe_depth_ramp(z + bx, bw, near, 0);
+			break;
+		}
+		ffe_depth_pack(dev, row, z, width);
+	}
+}
+
+/*
+ * Tiled NV12: the luma plane, then the interleaved chroma plane at half
+ * height, each cut into tile_w x tile_h tiles that are stored whole and in
+ * row-major order. The pattern is the same in every row, so each row of a
+ * tile is the same tile_w bytes of the line: they are loaded once into
+ * 64-bit words and stored tile_h times, then the first row of tiles is
+ * replicated down the plane.
+ */
+static void ffe_tile_row(u8 *dst, const u8 *line, unsigned int width, unsigned int tw, unsigned int th)
+{
+	unsigned int tx, r;
+	u64 a, b;
+
+	for (tx = 0; tx < width; tx += tw, dst += tw * th) {
+		if (tw == 16) {
+			a = get_unaligned((const u64 *)(line + tx));
+			b = get_unaligned((const u64 *)(line + tx + 8));
+			for (r = 0; r < th; r++) {
+				put_unaligned(a, (u64 *)(dst + r * 16));
+				put_unaligned(b, (u64 *)(dst + r * 16 + 8));
+			}
+		} else {
+			/* 4x4, two tile rows per word */
+			a = get_unaligned((const u32 *)(line + tx));
+			a |= a << 32;
+			for (r = 0; r < th; r += 2)
+				put_unaligned(a, (u64 *)(dst + r * 4));
+		}
+	}
+}
+
+static void ffe_tile_plane(u8 *dst, const u8 *line, unsigned int width, unsigned int height,
+			   unsigned int tw, unsigned int th, bool zero)
+{
+	size_t row = (size_t)width * th;
+
+	ffe_tile_row(dst, line, width, tw, th);
+	if (height / th > 1)
+		ffe_fill_doubling(dst + row, dst, row, height / th - 1, zero);
+}
+
+static void ffe_fill_tiled(struct dev_data *dev, u8 *vbuf, bool zero)
+{
+	unsigned int tw = dev->fmt->tile_w, th = dev->fmt->tile_h;
+	unsigned int off = dev->mv_count % dev->width;
+
+	ffe_tile_plane(vbuf, dev->line + off, dev->width, dev->height, tw, th, zero);
+	ffe_tile_plane(vbuf + dev->width * dev->height, dev->tile_uv + off, dev->width, dev->height / 2, tw, th, zero);
+}
+
+/* Tiles per row and column: stereo pairs, or 2, 3 or 2x2 sensors tiled */
+static void ffe_composite_grid(unsigned int layout, unsigned int sensors, unsigned int *cols, unsigned int *rows)
+{
+	switch (layout) {
+	case FFE_LAYOUT_SIDE_BY_SIDE:
+		*cols = 2;
+		*rows = 1;
+		break;
+	case FFE_LAYOUT_TOP_BOTTOM:
+		*cols = 1;
+		*rows = 2;
+		break;
+	default:
+		*cols = sensors == 4 ? 2 : sensors;
+		*rows = sensors == 4 ? 2 : 1;
+		break;
+	}
+}
+
+/*
+ * Stereo sensors see the same scene and differ only by the disparity shift,
+ * tiled sensors also start at evenly spaced phases of the pattern. Each tile
+ * band is composed into its first row and then replicated like a full frame.
+ */
+static void ffe_fill_composite(struct dev_data *dev, u8 *vbuf, const u8 *line, bool zero)
+{
+	unsigned int layout = READ_ONCE(dev->comp.layout);
+	unsigned int sensors = READ_ONCE(dev->comp.sensors);
+	unsigned int disparity = READ_ONCE(dev->comp.disparity);
+	unsigned int ps = dev->pixelsize, stride = dev->width * ps;
+	unsigned int cols, rows, tw, th, r, c, k, x, w, h, phase, off;
+	u8 *band;
+
+	ffe_composite_grid(layout, sensors, &cols, &rows);
+	tw = (dev->width / cols) & ~1;
+	th = dev->height / rows;
+
+	for (r = 0; r < rows; r++) {
+		band = vbuf + r * th * stride;
+		h = r == rows - 1 ? dev->height - r * th : th;
+		for (c = 0; c < cols; c++) {
+			k = r * cols + c;
+			x = c * tw;
+			w = c == cols - 1 ? dev->width - x : tw;
+			phase = layout == FFE_LAYOUT_TILED ? (k * dev->width / sensors) & ~1 : 0;
+			off = (dev->mv_count + phase + k * disparity) % dev->width;
+			memcpy(band + x * ps, line + off * ps, w * ps);
+		}
+
+		if (h < 2)
+			continue;
+		if (READ_ONCE(fill_mode) == FFE_FILL_ROWS)
+			ffe_fill_rows(band + stride, band, stride, h - 1, zero);
+		else
+			ffe_fill_doubling(band + stride, band, stride, h - 1, zero);
+	}
+}
+
+/*
+ * Deadline of the tick, shifted by the timestamp error of a replayed trace.
+ * The virtual clock starts at zero, so a negative offset is clamped there.
+ */
+static u64 ffe_frame_timestamp(struct dev_data *dev)
+{
+	return max_t(s64, ktime_to_ns(dev->vidq.next) + dev->trace.ts_offset, 0);
+}
+
+static void ffe_fillbuff(struct dev_data *dev, struct ffe_buffer *buf)
+{
+	void *vbuf = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
+	/* only vb2's own vmalloc pages are known to be cacheable */
+	bool zero = buf->vb.vb2_buf.memory == V4L2_MEMORY_MMAP;
+	unsigned int e = ffe_hdr_exposure(dev);
+	unsigned int size, height, i;
+	u64 start_ns;
+	u8 *line, *start;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (!vbuf) {
+		v4l2_err(&dev->v4l2_dev, "%s: buffer error..\n", __func__);
+		return;
+	}
+
+	size = dev->width * dev->pixelsize;
+	height = dev->height;
+	/* an exposure line not built yet shows the plain pattern */
+	line = dev->hdr.exposures > 1 && dev->hdr.line[e] ? dev->hdr.line[e] : dev->line;
+	start = line + (dev->mv_count % dev->width) * dev->pixelsize;
+
+	start_ns = ktime_get_ns();
+	if (!ffe_source_fill(dev, vbuf, zero)) {
+		if (dev->fmt->is_depth)
+			ffe_fill_depth(dev, vbuf, zero);
+		else if (dev->fmt->tile_w)
+			ffe_fill_tiled(dev, vbuf, zero);
+		else if (READ_ONCE(dev->comp.layout) != FFE_LAYOUT_MONO)
+			ffe_fill_composite(dev, vbuf, line, zero);
+		else if (READ_ONCE(fill_mode) == FFE_FILL_ROWS)
+			ffe_fill_rows(vbuf, start, size, height, zero);
+		else
+			ffe_fill_doubling(vbuf, start, size, height, zero);
+	} else if (dev->hdr.exposures > 1 && ffe_fmt_packed(dev->fmt)) {
+		for (i = 0; i < height; i++)
+			ffe_hdr_row(dev, e, (u8 *)vbuf + i * size, dev->width);
+	}
+	dev->fill_ns += ktime_get_ns() - start_ns;
+	dev->fill_bytes += ffe_image_size(dev->fmt, dev->width, height);
+	dev->fill_frames++;
+
+	dev->hdr.frames[e]++;
+	dev->mv_count += 2;
+	buf->vb.field = V4L2_FIELD_INTERLACED;
+	buf->vb.sequence = dev->f_count;
+	buf->vb.vb2_buf.timestamp = ffe_frame_timestamp(dev);
+	ffe_osd_draw(dev, buf, vbuf);
+}
+
+static void ffe_copybuff(struct dev_data *dev, struct ffe_buffer *src, struct ffe_buffer *dst)
+{
+	void *sbuf = vb2_plane_vaddr(&src->vb.vb2_buf, 0);
+	void *dbuf = vb2_plane_vaddr(&dst->vb.vb2_buf, 0);
+	bool zero = dst->vb.vb2_buf.memory == V4L2_MEMORY_MMAP;
+
+	if (!sbuf || !dbuf) {
+		v4l2_err(&dev->v4l2_dev, "%s: buffer error..\n", __func__);
+		return;
+	}
+
+	ffe_copy(dbuf, sbuf, vb2_get_plane_payload(&src->vb.vb2_buf, 0), zero);
+	dst->vb.field = src->vb.field;
+	dst->vb.sequence = src->vb.sequence;
+	dst->vb.vb2_buf.timestamp = src->vb.vb2_buf.timestamp;
+}
+
+/* One tick per exposure, so HDR runs the clock at exposures times the frame rate */
+static u64 ffe_frame_interval(struct dev_data *dev)
+{
+	return div_u64((u64)dev->time_per_frame.numerator * NSEC_PER_SEC,
+		       dev->time_per_frame.denominator * dev->hdr.exposures);
+}
+
+/*
+ * Timing trace replay. The records of a recorded camera replace the fixed
+ * interval: each gives the gap to its frame, whether the camera dropped it
+ * and how far its timestamp was off. The trace loops for as long as the
+ * stream runs.
+ */
+static int ffe_trace_load(struct dev_data *dev, const char *path)
+{
+	struct ffe_trace *t = &dev->trace;
+	void *data = NULL;
+	loff_t size = 0;
+	int ret;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+
+	/* a trace that fails to load leaves the current one playing */
+	if (path[0]) {
+		ret = kernel_read_file_from_path(path, &data, &size,
+						 FFE_TRACE_MAX * sizeof(struct ffe_trace_record), READING_UNKNOWN);
+		if (ret) {
+			v4l2_err(&dev->v4l2_dev, "%s: cannot read %s (%d)..\n", __func__, path, ret);
+			return ret;
+		}
+		if (!size || size % sizeof(struct ffe_trace_record)) {
+			v4l2_err(&dev->v4l2_dev, "%s: %s is not a list of trace records..\n", __func__, path);
+			vfree(data);
+			return -EINVAL;
+		}
+	}
+
+	vfree(t->recs);
+	ffe_mem_account(dev, FFE_MEM_SOURCE, -(long)(t->n * sizeof(struct ffe_trace_record)));
+	t->recs = data;
+	t->n = size / sizeof(struct ffe_trace_record);
+	t->pos = 0;
+	t->ts_offset = 0;
+	strlcpy(t->path, path, sizeof(t->path));
+	if (!t->n)
+		return 0;
+
+	ffe_mem_account(dev, FFE_MEM_SOURCE, size);
+	v4l2_info(&dev->v4l2_dev, "%s: %s, %u frames\n", __func__, t->path, t->n);
+	return 0;
+}
+
+/* Interval to the next tick, moving the trace on to that tick's record */
+static u64 ffe_next_interval(struct dev_data *dev)
+{
+	struct ffe_trace *t = &dev->trace;
+
+	if (!t->n)
+		return ffe_frame_interval(dev);
+	t->pos = (t->pos + 1) % t->n;
+	/* a zero interval would spin the generator */
+	return max_t(u64, le32_to_cpu(t->recs[t->pos].interval_ns), NSEC_PER_USEC);
+}
+
+static void ffe_trace_skip(struct dev_data *dev, u64 count)
+{
+	struct ffe_trace *t = &dev->trace;
+
+	if (t->n)
+		t->pos = (t->pos + do_div(count, t->n)) % t->n;
+}
+
+/* Apply the current record; true when the recorded camera dropped this frame */
+static bool ffe_trace_tick(struct dev_data *dev)
+{
+	struct ffe_trace *t = &dev->trace;
+
+	if (!t->n)
+		return false;
+	t->ts_offset = (s32)le32_to_cpu(t->recs[t->pos].ts_offset_ns);
+	if (!(le32_to_cpu(t->recs[t->pos].flags) & FFE_TRACE_DROP))
+		return false;
+	t->drops++;
+	return true;
+}
+
+/*
+ * Frames the sensor would have produced but nobody could take still advance
+ * the sequence, so consumers see the gap as dropped frames.
+ */
+static void ffe_drop_frames(struct dev_data *dev, unsigned int count)
+{
+	dev->f_count += count;
+	dev->dropped += count;
+	dev->mv_count += 2 * count;
+}
+
+static void ffe_clock_advance(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
+	u64 interval = ffe_next_interval(dev);
+	ktime_t now = ktime_get();
+	u64 late;
+
+	q->frame++;
+	q->next = ktime_add_ns(q->next, interval);
+
+	/* never burst to catch up, skip the frames we were too late for */
+	if (interval && !q->virt && ktime_after(now, q->next)) {
+		late = div64_u64(ktime_to_ns(ktime_sub(now, q->next)), interval);
+		if (late) {
+			ffe_drop_frames(dev, late);
+			ffe_trace_skip(dev, late);
+			q->frame += late;
+			q->next = ktime_add_ns(q->next, late * interval);
+		}
+	}
+}
+
+/*
+ * Restart pacing from the current time without accounting the gap as drops.
+ * Used after system resume and when the frame interval changes while
+ * streaming, so the first frames after it neither burst nor skew.
+ */
+static void ffe_clock_rebase(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
+
+	v4l2_info(&dev->v4l2_dev, "%s: sequence %u\n", __func__, dev->f_count);
+	WRITE_ONCE(q->rebase, false);
+	if (!q->virt)
+		q->next = ktime_get();
+	q->starved = 0;
+}
+
+static void ffe_park(struct dev_data *dev)
+{
+	v4l2_info(&dev->v4l2_dev, "%s: no buffers for %u ticks, parking frame clock\n", __func__, dev->vidq.starved);
+	WRITE_ONCE(dev->vidq.parked, true);
+}
+
+static void ffe_unpark(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
+	u64 interval = ffe_frame_interval(dev);
+	ktime_t now = ktime_get();
+	u64 missed = 0;
+
+	/* account the ticks that elapsed while parked and fire the next one now */
+	if (ktime_after(now, q->next))
+		missed = div64_u64(ktime_to_ns(ktime_sub(now, q->next)), interval);
+	ffe_drop_frames(dev, missed);
+	q->frame += missed;
+	q->next = now;
+	q->starved = 0;
+	WRITE_ONCE(q->parked, false);
+	v4l2_info(&dev->v4l2_dev, "%s: resumed after %llu ticks\n", __func__, missed);
+}
+
+static bool ffe_has_buffers(struct dev_data *dev)
+{
+	struct ffe_consumer *cons;
+	unsigned long flags = 0;
+	bool ret = false;
+
+	spin_lock_irqsave(&dev->s_lock, flags);
+	list_for_each_entry(cons, &dev->vidq.consumers, node) {
+		if (!list_empty(&cons->active)) {
+			ret = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+	return ret;
+}
+
+/*
+ * Telemetry ring. Only the generator thread writes it: each record is
+ * bracketed by its lock going odd and back to even, and head is published
+ * with release semantics once the record is complete, so readers in other
+ * processes need no syscall and never block the generator. The ring is only
+ * allocated when a monitor first maps it; until then nothing is recorded.
+ */
+static void ffe_telemetry_init(struct dev_data *dev)
+{
+	unsigned int n = READ_ONCE(telemetry_records);
+
+	if (n)
+		dev->telemetry_size = PAGE_ALIGN(sizeof(struct ffe_telemetry_header) +
+						 roundup_pow_of_two(n) * sizeof(struct ffe_telemetry_record));
+}
+
+static int ffe_telemetry_alloc(struct dev_data *dev)
+{
+	struct ffe_telemetry_header *hdr;
+
+	if (READ_ONCE(dev->telemetry))
+		return 0;
+
+	hdr = vmalloc_user(dev->telemetry_size);
+	if (!hdr)
+		return -ENOMEM;
+
+	hdr->version = FFE_TELEMETRY_VERSION;
+	hdr->record_size = sizeof(struct ffe_telemetry_record);
+	/* read-only parameter, so the same count that sized the ring */
+	hdr->n_records = roundup_pow_of_two(READ_ONCE(telemetry_records));
+	hdr->records_offset = sizeof(*hdr);
+	/* publishes the header to the generator; a racing mapper may have won */
+	if (cmpxchg(&dev->telemetry, NULL, hdr)) {
+		vfree(hdr);
+		return 0;
+	}
+	ffe_mem_account(dev, FFE_MEM_TELEMETRY, dev->telemetry_size);
+	return 0;
+}
+
+static unsigned int ffe_queued_buffers(struct dev_data *dev)
+{
+	struct ffe_consumer *cons;
+	struct list_head *pos;
+	unsigned long flags = 0;
+	unsigned int n = 0;
+
+	spin_lock_irqsave(&dev->s_lock, flags);
+	list_for_each_entry(cons, &dev->vidq.consumers, node)
+		list_for_each(pos, &cons->active)
+			n++;
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+	return n;
+}
+
+static void ffe_telemetry_write(struct dev_data *dev, u32 sequence, u64 start_ns, u64 fill_ns,
+				unsigned int delivered, u32 flags)
+{
+	struct ffe_telemetry_header *hdr = READ_ONCE(dev->telemetry);
+	struct ffe_telemetry_record *rec;
+	u32 head;
+
+	if (!hdr)
+		return;
+
+	head = hdr->head;
+	rec = (void *)hdr + hdr->records_offset + (head & (hdr->n_records - 1)) * sizeof(*rec);
+	WRITE_ONCE(rec->lock, rec->lock + 1);
+	smp_wmb();
+	rec->sequence = sequence;
+	rec->timestamp_ns = ffe_frame_timestamp(dev);
+	rec->start_ns = start_ns;
+	rec->fill_ns = fill_ns;
+	rec->queued = ffe_queued_buffers(dev);
+	rec->delivered = delivered;
+	rec->dropped = dev->dropped;
+	rec->flags = flags;
+	smp_wmb();
+	WRITE_ONCE(rec->lock, rec->lock + 1);
+	smp_store_release(&hdr->head, head + 1);
+}
+
+static int ffe_telemetry_mmap(struct dev_data *dev, struct vm_area_struct *vma)
+{
+	int ret;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (!dev->telemetry_size)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_end - vma->vm_start > dev->telemetry_size)
+		return -EINVAL;
+
+	ret = ffe_telemetry_alloc(dev);
+	if (ret)
+		return ret;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, dev->telemetry, 0);
+}
+
+/*
+ * Explicit sync. Every queued buffer carries a fence on its queue's timeline
+ * that signals when the frame has been written, or in error when the buffer
+ * is returned empty. FFE_IOC_G_FENCE exports it as a sync_file, so a buffer
+ * can be passed down a pipeline right after QBUF and the next stage waits on
+ * the fence instead of on DQBUF.
+ */
+static const char *ffe_fence_driver_name(struct dma_fence *fence)
+{
+	return KBUILD_MODNAME;
+}
+
+static const char *ffe_fence_timeline_name(struct dma_fence *fence)
+{
+	return "capture";
+}
+
+static bool ffe_fence_enable_signaling(struct dma_fence *fence)
+{
+	return true;
+}
+
+static const struct dma_fence_ops ffe_fence_ops = {
+	.get_driver_name		= ffe_fence_driver_name,
+	.get_timeline_name		= ffe_fence_timeline_name,
+	.enable_signaling		= ffe_fence_enable_signaling,
+	.wait				= dma_fence_default_wait,
+};
+
+static void ffe_signal_fence(struct dev_data *dev, struct ffe_buffer *buf, int error)
+{
+	struct dma_fence *fence;
+	unsigned long flags = 0;
+
+	spin_lock_irqsave(&dev->s_lock, flags);
+	fence = buf->fence;
+	buf->fence = NULL;
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+
+	if (!fence)
+		return;
+	if (error)
+		dma_fence_set_error(fence, error);
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+}
+
+/* V4L2_EVENT_FRAME_SYNC as a frame starts, ahead of its buffer fence */
+static void ffe_frame_sync(struct dev_data *dev)
+{
+	struct v4l2_event ev = {
+		.type				= V4L2_EVENT_FRAME_SYNC,
+		.u.frame_sync.frame_sequence	= dev->f_count,
+	};
+
+	v4l2_event_queue(&dev->vdev, &ev);
+}
+
+static void ffe_thread_tick(struct dev_data *dev)
+{
+	struct ffe_dmaq *q;
+	struct ffe_consumer *cons, *ctmp;
+	struct ffe_buffer *buf, *first, *tmp;
+	unsigned int limit, delivered = 1;
+	unsigned long flags = 0;
+	u64 start_ns, fill_ns;
+	LIST_HEAD(ready);
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	q = &dev->vidq;
+	start_ns = ktime_get_ns();
+
+	/* the recorded camera lost this one, whatever is queued */
+	if (ffe_trace_tick(dev)) {
+		ffe_drop_frames(dev, 1);
+		ffe_telemetry_write(dev, dev->f_count - 1, start_ns, 0, 0, FFE_TELEMETRY_DROPPED);
+		return;
+	}
+
+	mutex_lock(&dev->gen_lock);
+	spin_lock_irqsave(&dev->s_lock, flags);
+
+	list_for_each_entry_safe(cons, ctmp, &q->consumers, node) {
+		if (list_empty(&cons->active)) {
+			cons->dropped++;
+			continue;
+		}
+		buf = list_entry(cons->active.next, struct ffe_buffer, list);
+		list_move_tail(&buf->list, &ready);
+		cons->delivered++;
+
+		/* deal the frame to one consumer and send it to the back of the line */
+		if (dev->consumer_mode == FFE_CONSUMER_ROUND_ROBIN) {
+			list_move_tail(&cons->node, &q->consumers);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+
+	if (list_empty(&ready)) {
+		mutex_unlock(&dev->gen_lock);
+		if (!q->starved++)
+			v4l2_err(&dev->v4l2_dev, "%s: No active queue\n", __func__);
+		ffe_drop_frames(dev, 1);
+		ffe_telemetry_write(dev, dev->f_count - 1, start_ns, 0, 0, FFE_TELEMETRY_DROPPED);
+
+		limit = READ_ONCE(idle_ticks);
+		if (limit && !q->virt && q->starved >= limit)
+			ffe_park(dev);
+		return;
+	}
+
+	/* render once, copy to the other consumers, complete the source last */
+	q->starved = 0;
+	first = list_first_entry(&ready, struct ffe_buffer, list);
+	list_del(&first->list);
+	ffe_frame_sync(dev);
+	ffe_fillbuff(dev, first);
+	ffe_signal_fence(dev, first, 0);
+
+	list_for_each_entry_safe(buf, tmp, &ready, list) {
+		list_del(&buf->list);
+		ffe_copybuff(dev, first, buf);
+		ffe_signal_fence(dev, buf, 0);
+		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+		delivered++;
+	}
+	vb2_buffer_done(&first->vb.vb2_buf, VB2_BUF_STATE_DONE);
+	fill_ns = ktime_get_ns() - start_ns;
+	ffe_telemetry_write(dev, dev->f_count, start_ns, fill_ns, delivered,
+			    ffe_hdr_exposure(dev) << FFE_TELEMETRY_EXPOSURE_SHIFT);
+	dev->f_count++;
+	mutex_unlock(&dev->gen_lock);
+
+	if (!dev->ttff_ns) {
+		dev->ttff_ns = ktime_get_ns() - dev->stream_ns;
+		v4l2_info(&dev->v4l2_dev, "%s: time to first frame %llu us\n", __func__, div_u64(dev->ttff_ns, NSEC_PER_USEC));
+	}
+}
+
+/*
+ * Virtual clock: wait for FFE_IOC_STEP instead of a deadline. Time only
+ * moves by the frame interval per tick, so nothing is ever late and the
+ * clock never parks.
+ */
+static void ffe_step_wait(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
+
+	wait_event_freezable(q->wq, atomic_read(&q->steps) > 0 || kthread_should_stop());
+	if (kthread_should_stop())
+		return;
+	if (READ_ONCE(q->rebase))
+		ffe_clock_rebase(dev);
+
+	atomic_dec(&q->steps);
+	ffe_thread_tick(dev);
+	ffe_clock_advance(dev);
+}
+
+static void ffe_sleep(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
+	ktime_t expires;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (kthread_should_stop()) {
+		v4l2_err(&dev->v4l2_dev, "%s: kthread should stop\n", __func__);
+		return;
+	}
+
+	if (q->virt) {
+		ffe_step_wait(dev);
+		return;
+	}
+
+	if (READ_ONCE(q->rebase))
+		ffe_clock_rebase(dev);
+
+	if (q->parked) {
+		wait_event_freezable(q->wq, ffe_has_buffers(dev) || kthread_should_stop());
+		if (kthread_should_stop())
+			return;
+		if (READ_ONCE(q->rebase))
+			ffe_clock_rebase(dev);
+		ffe_unpark(dev);
+	}
+
+	ffe_thread_tick(dev);
+	if (q->parked)
+		return;
+	ffe_clock_advance(dev);
+
+	/* absolute deadlines, so pacing does not drift with fill time */
+	expires = q->next;
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!kthread_should_stop())
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	__set_current_state(TASK_RUNNING);
+	try_to_freeze();
+}
+
+static int ffe_thread(void *data)
+{
+	struct dev_data *dev = data;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	set_freezable();
+
+	while (1) {
+		ffe_sleep(dev);
+		if (kthread_should_stop())
+			break;
+	}
+	v4l2_info(&dev->v4l2_dev, "%s: exit\n", __func__);
+	return 0;
+}
+
+static int ffe_start_generating(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
 	dev->mv_count = 0;
 	dev->jiffies = jiffies;
 	q->frame = 0;
-	q->jiffies = jiffies;
+	q->virt = READ_ONCE(virtual_clock);
+	q->next = q->virt ? ktime_set(0, 0) : ktime_get();
+	atomic_set(&q->steps, 0);
+	q->starved = 0;
+	q->parked = false;
+	q->rebase = false;
 	q->kthread = kthread_run(ffe_thread, dev, "%s", dev->v4l2_dev.name);
 
 	if (IS_ERR(q->kthread)) {
@@ -506,366 +3146,1047 @@ static int ffe_start_generating(struct dev_data *dev)
 		return PTR_ERR(q->kthread);
 	}
 
-	wake_up_interruptible(&q->wq);
+	wake_up_interruptible(&q->wq);
+	return 0;
+}
+
+static void ffe_stop_generating(struct dev_data *dev)
+{
+	struct ffe_dmaq *q = &dev->vidq;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (q->kthread) {
+		kthread_stop(q->kthread);
+		q->kthread = NULL;
+	}
+}
+
+static void ffe_return_buffers(struct ffe_consumer *cons, enum vb2_buffer_state state)
+{
+	struct dev_data *dev = cons->dev;
+	struct ffe_buffer *buf, *tmp;
+	unsigned long flags = 0;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&dev->s_lock, flags);
+	list_splice_init(&cons->active, &done);
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+
+	list_for_each_entry_safe(buf, tmp, &done, list) {
+		list_del(&buf->list);
+		ffe_signal_fence(dev, buf, -ECANCELED);
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+	}
+}
+
+/* Tiled formats give the luma stride, the chroma plane follows the luma */
+static void ffe_pix_size(const struct ffe_fmt *fmt, struct v4l2_pix_format *pix)
+{
+	pix->bytesperline = fmt->tile_w ? pix->width : (pix->width * fmt->depth) >> 3;
+	pix->sizeimage = ffe_image_size(fmt, pix->width, pix->height);
+}
+
+/*
+ * The current format as one consistent snapshot. Queue callbacks, G_FMT and
+ * G_PARM take no device lock; S_FMT and S_PARM write under dev->mutex inside
+ * fmt_seq.
+ */
+static void ffe_get_format(struct dev_data *dev, struct v4l2_pix_format *pix)
+{
+	const struct ffe_fmt *fmt;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->fmt_seq);
+		fmt = dev->fmt;
+		pix->width = dev->width;
+		pix->height = dev->height;
+		pix->colorspace = dev->colorspace;
+		pix->ycbcr_enc = dev->ycbcr_enc;
+		pix->quantization = dev->quantization;
+		pix->xfer_func = dev->xfer_func;
+	} while (read_seqcount_retry(&dev->fmt_seq, seq));
+
+	pix->field = V4L2_FIELD_INTERLACED;
+	pix->pixelformat = fmt->fourcc;
+	ffe_pix_size(fmt, pix);
+}
+
+static struct v4l2_fract ffe_get_interval(struct dev_data *dev)
+{
+	struct v4l2_fract tpf;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->fmt_seq);
+		tpf = dev->time_per_frame;
+	} while (read_seqcount_retry(&dev->fmt_seq, seq));
+	return tpf;
+}
+
+static int queue_setup(struct vb2_queue *vq, unsigned int *nbuffers, unsigned int *nplanes, unsigned int sizes[], struct device *alloc_ctxs[])
+{
+	struct ffe_consumer *cons = vb2_get_drv_priv(vq);
+	struct dev_data *dev = cons->dev;
+	struct v4l2_pix_format pix;
+	unsigned long size;
+
+	ffe_get_format(dev, &pix);
+	size = pix.sizeimage;
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+
+	*nplanes = 1;
+	sizes[0] = size;
+
+	v4l2_info(&dev->v4l2_dev, "%s: count = %d, size = %ld\n", __func__, *nbuffers, size);
+	return 0;
+}
+
+static int buffer_prepare(struct vb2_buffer *vb)
+{
+	struct ffe_consumer *cons = vb2_get_drv_priv(vb->vb2_queue);
+	struct dev_data *dev = cons->dev;
+	struct v4l2_pix_format pix;
+	struct ffe_buffer *buf;
+	unsigned long size;
+	int ret;
+
+	buf = container_of(vb, struct ffe_buffer, vb.vb2_buf);
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+
+	ffe_get_format(dev, &pix);
+	if (pix.width < 48 || pix.width > MAX_WIDTH || pix.height < 32 || pix.height > MAX_HEIGHT) {
+		v4l2_err(&dev->v4l2_dev, "%s: width or/and height is/are not in expected range..\n", __func__);
+		return -EINVAL;
+	}
+
+	size = pix.sizeimage;
+	if (vb2_plane_size(vb, 0) < size) {
+		v4l2_err(&dev->v4l2_dev, "%s: data will not fit into the plane (%lu < %lu)..\n", __func__, vb2_plane_size(vb, 0), size);
+		return -EINVAL;
+	}
+
+	vb2_set_plane_payload(&buf->vb.vb2_buf, 0, size);
+
+	/* QBUF takes the device lock only when the pattern has to be rebuilt */
+	if (READ_ONCE(dev->pattern_valid))
+		return 0;
+	mutex_lock(&dev->mutex);
+	ret = ffe_prepare_pattern(dev);
+	mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+static void buffer_queue(struct vb2_buffer *vb)
+{
+	struct ffe_consumer *cons = vb2_get_drv_priv(vb->vb2_queue);
+	struct dev_data *dev = cons->dev;
+	struct dma_fence *fence;
+	struct ffe_buffer *buf;
+	unsigned long flags = 0;
+
+	buf = container_of(vb, struct ffe_buffer, vb.vb2_buf);
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+
+	/* without a fence the buffer still works, FFE_IOC_G_FENCE just fails */
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL_ACCOUNT);
+
+	spin_lock_irqsave(&dev->s_lock, flags);
+	if (fence)
+		dma_fence_init(fence, &ffe_fence_ops, &dev->fence_lock, cons->fence_ctx, ++cons->fence_seqno);
+	buf->fence = fence;
+	list_add_tail(&buf->list, &cons->active);
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+
+	/* a parked frame clock resumes on the first buffer */
+	wake_up_interruptible(&dev->vidq.wq);
+}
+
+/*
+ * The generator runs while at least one consumer streams. Membership of the
+ * consumer list changes under gen_lock, so a consumer never leaves while the
+ * generator still holds one of its buffers.
+ */
+static void ffe_attach_consumer(struct ffe_consumer *cons)
+{
+	struct dev_data *dev = cons->dev;
+	unsigned long flags = 0;
+
+	mutex_lock(&dev->gen_lock);
+	spin_lock_irqsave(&dev->s_lock, flags);
+	list_add_tail(&cons->node, &dev->vidq.consumers);
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+	mutex_unlock(&dev->gen_lock);
+}
+
+static void ffe_detach_consumer(struct ffe_consumer *cons)
+{
+	struct dev_data *dev = cons->dev;
+	unsigned long flags = 0;
+
+	mutex_lock(&dev->gen_lock);
+	spin_lock_irqsave(&dev->s_lock, flags);
+	list_del_init(&cons->node);
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+	mutex_unlock(&dev->gen_lock);
+}
+
+static int start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct ffe_consumer *cons = vb2_get_drv_priv(vq);
+	struct dev_data *dev = cons->dev;
+	unsigned long size;
+	unsigned int i;
+	int ret = 0;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	cons->delivered = 0;
+	cons->dropped = 0;
+
+	/* the generator and its counters are shared by every consumer queue */
+	mutex_lock(&dev->mutex);
+
+	/* controls set since the buffers were prepared only invalidated the pattern */
+	ret = ffe_prepare_pattern(dev);
+
+	/* S_FMT does not take the queue lock, so the buffers may predate the format */
+	size = ffe_image_size(dev->fmt, dev->width, dev->height);
+	for (i = 0; !ret && i < vq->num_buffers; i++) {
+		if (vb2_plane_size(vq->bufs[i], 0) < size) {
+			v4l2_err(&dev->v4l2_dev, "%s: buffer %u is too small for the format (%lu < %lu)..\n",
+				 __func__, i, vb2_plane_size(vq->bufs[i], 0), size);
+			ret = -EINVAL;
+		}
+	}
+	if (ret) {
+		mutex_unlock(&dev->mutex);
+		ffe_return_buffers(cons, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	if (!dev->streaming) {
+		dev->f_count = 0;
+		dev->dropped = 0;
+		dev->fill_ns = 0;
+		dev->fill_bytes = 0;
+		dev->fill_frames = 0;
+		dev->osd_ns = 0;
+		dev->ttff_ns = 0;
+		dev->stream_ns = ktime_get_ns();
+		ffe_source_rewind(dev);
+		dev->trace.pos = 0;
+		dev->trace.drops = 0;
+		memset(dev->hdr.frames, 0, sizeof(dev->hdr.frames));
+	}
+
+	ffe_attach_consumer(cons);
+	if (!dev->streaming)
+		ret = ffe_start_generating(dev);
+	if (ret) {
+		ffe_detach_consumer(cons);
+		mutex_unlock(&dev->mutex);
+		ffe_return_buffers(cons, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	dev->streaming++;
+	mutex_unlock(&dev->mutex);
+	wake_up_interruptible(&dev->vidq.wq);
+	return 0;
+}
+
+static void stop_streaming(struct vb2_queue *vq)
+{
+	struct ffe_consumer *cons = vb2_get_drv_priv(vq);
+	struct dev_data *dev = cons->dev;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	mutex_lock(&dev->mutex);
+	ffe_detach_consumer(cons);
+	if (!--dev->streaming)
+		ffe_stop_generating(dev);
+	mutex_unlock(&dev->mutex);
+	ffe_return_buffers(cons, VB2_BUF_STATE_ERROR);
+
+	/* imports still attached to a buffer stay until it is detached */
+	if (!READ_ONCE(dev->streaming))
+		ffe_import_flush(dev);
+}
+
+static const struct vb2_ops ffe_qops = {
+	.queue_setup			= queue_setup,
+	.buf_prepare			= buffer_prepare,
+	.buf_queue			= buffer_queue,
+	.start_streaming		= start_streaming,
+	.stop_streaming			= stop_streaming,
+	.wait_prepare			= vb2_ops_wait_prepare,
+	.wait_finish			= vb2_ops_wait_finish,
+};
+
+static int ffe_init_queue(struct dev_data *dev, struct ffe_consumer *cons)
+{
+	struct vb2_queue *q = &cons->queue;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	cons->dev = dev;
+	INIT_LIST_HEAD(&cons->active);
+	INIT_LIST_HEAD(&cons->node);
+	mutex_init(&cons->lock);
+
+	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	q->io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ;
+	q->drv_priv = cons;
+	q->buf_struct_size = sizeof(struct ffe_buffer);
+	q->ops = &ffe_qops;
+	q->mem_ops = &ffe_memops;
+	q->lock = &cons->lock;
+	q->dev = &dev->pdev->dev;
+	cons->fence_ctx = dma_fence_context_alloc(1);
+	cons->fence_seqno = 0;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	return vb2_queue_init(q);
+}
+
+/* per-handle consumer in broadcast mode, NULL when the device queue is used */
+static struct ffe_consumer *ffe_fh_consumer(struct file *file)
+{
+	struct dev_data *dev = video_drvdata(file);
+
+	if (dev->consumer_mode == FFE_CONSUMER_EXCLUSIVE)
+		return NULL;
+	return &container_of(file->private_data, struct ffe_fh, fh)->cons;
+}
+
+static bool ffe_is_busy(struct dev_data *dev)
+{
+	struct v4l2_fh *fh;
+	unsigned long flags = 0;
+	bool busy = false;
+
+	if (dev->consumer_mode == FFE_CONSUMER_EXCLUSIVE)
+		return vb2_is_busy(&dev->cons.queue);
+
+	spin_lock_irqsave(&dev->vdev.fh_lock, flags);
+	list_for_each_entry(fh, &dev->vdev.fh_list, list)
+		busy |= vb2_is_busy(&container_of(fh, struct ffe_fh, fh)->cons.queue);
+	spin_unlock_irqrestore(&dev->vdev.fh_lock, flags);
+	return busy;
+}
+
+static int vidioc_querycap(struct file *file, void  *priv, struct v4l2_capability *cap)
+{
+	struct dev_data *dev = video_drvdata(file);
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	strcpy(cap->driver, KBUILD_MODNAME);
+	strcpy(cap->card, KBUILD_MODNAME);
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%s", dev->v4l2_dev.name);
+	cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+	return 0;
+}
+
+static int vidioc_enum_fmt_vid_cap(struct file *file, void *priv, struct v4l2_fmtdesc *f)
+{
+	const struct ffe_fmt *fmt;
+	struct dev_data *dev = video_drvdata(file);
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	if (f->index >= ARRAY_SIZE(formats))
+		return -EINVAL;
+
+	fmt = &formats[f->index];
+
+	strlcpy(f->description, fmt->name, sizeof(f->description));
+	f->pixelformat = fmt->fourcc;
+	return 0;
+}
+
+static int vidioc_g_fmt_vid_cap(struct file *file, void *priv, struct v4l2_format *f)
+{
+	struct dev_data *dev = video_drvdata(file);
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	ffe_get_format(dev, &f->fmt.pix);
 	return 0;
 }
 
-static void ffe_stop_generating(struct dev_data *dev)
+/*
+ * Y'CbCr formats may ask for BT.601, BT.709 or BT.2020 in either range;
+ * anything else falls back to the SMPTE 170M/limited defaults.  RGB is
+ * always full-range sRGB, depth and IR raw.
+ */
+static void ffe_try_colorimetry(const struct ffe_fmt *fmt, struct v4l2_pix_format *pix)
 {
-	struct ffe_dmaq *q = &dev->vidq;
+	if (fmt->is_depth) {
+		pix->colorspace = V4L2_COLORSPACE_RAW;
+		pix->ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+		pix->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+		pix->xfer_func = V4L2_XFER_FUNC_NONE;
+		return;
+	}
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (q->kthread) {
-		kthread_stop(q->kthread);
-		q->kthread = NULL;
+	if (!fmt->is_yuv) {
+		pix->colorspace = V4L2_COLORSPACE_SRGB;
+		pix->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(pix->colorspace);
+		pix->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+		pix->xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(pix->colorspace);
+		return;
 	}
 
-	while (!list_empty(&q->active)) {
-		struct ffe_buffer *buf;
+	switch (pix->colorspace) {
+	case V4L2_COLORSPACE_SMPTE170M:
+	case V4L2_COLORSPACE_REC709:
+	case V4L2_COLORSPACE_BT2020:
+		break;
+	default:
+		pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+		break;
+	}
 
-		buf = list_entry(q->active.next, struct ffe_buffer, list);
-		list_del(&buf->list);
-		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
+	switch (pix->ycbcr_enc) {
+	case V4L2_YCBCR_ENC_601:
+	case V4L2_YCBCR_ENC_709:
+	case V4L2_YCBCR_ENC_BT2020:
+		break;
+	default:
+		pix->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(pix->colorspace);
+		break;
 	}
+
+	if (pix->quantization != V4L2_QUANTIZATION_FULL_RANGE)
+		pix->quantization = V4L2_QUANTIZATION_LIM_RANGE;
+	pix->xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(pix->colorspace);
 }
 
-static int queue_setup(struct vb2_queue *vq, unsigned int *nbuffers, unsigned int *nplanes, unsigned int sizes[], struct device *alloc_ctxs[])
+static int vidioc_try_fmt_vid_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
-	struct dev_data *dev;
-	unsigned long size;
+	struct dev_data *dev = video_drvdata(file);
+	const struct ffe_fmt *fmt;
 
-	dev = vb2_get_drv_priv(vq);
-	size = dev->width * dev->height * dev->pixelsize;
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	fmt = get_format(f->fmt.pix.pixelformat);
+	if (!fmt) {
+		v4l2_err(&dev->v4l2_dev, "%s: Unknown format..\n", __func__);
+		f->fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+		fmt = get_format(f->fmt.pix.pixelformat);
+	}
 
-	*nplanes = 1;
-	sizes[0] = size;
-
-	v4l2_info(&dev->v4l2_dev, "%s: count = %d, size = %ld\n", __func__, *nbuffers, size);
+	f->fmt.pix.field = V4L2_FIELD_INTERLACED;
+	/* the pattern line and every per-line buffer are sized for MAX_WIDTH */
+	f->fmt.pix.width = clamp_t(u32, f->fmt.pix.width, 48, MAX_WIDTH) & ~3;
+	f->fmt.pix.height = clamp_t(u32, f->fmt.pix.height, 32, MAX_HEIGHT);
+	if (fmt->tile_w) {
+		/* whole tiles in both planes, chroma being half height, still within the limits */
+		f->fmt.pix.width = ALIGN(f->fmt.pix.width, fmt->tile_w);
+		if (f->fmt.pix.width > MAX_WIDTH)
+			f->fmt.pix.width = rounddown(MAX_WIDTH, fmt->tile_w);
+		f->fmt.pix.height = ALIGN(f->fmt.pix.height, 2 * fmt->tile_h);
+		if (f->fmt.pix.height > MAX_HEIGHT)
+			f->fmt.pix.height = rounddown(MAX_HEIGHT, 2 * fmt->tile_h);
+	}
+	ffe_pix_size(fmt, &f->fmt.pix);
+	ffe_try_colorimetry(fmt, &f->fmt.pix);
 	return 0;
 }
 
-static int buffer_prepare(struct vb2_buffer *vb)
+static int vidioc_s_fmt_vid_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
-	struct dev_data *dev;
-	struct ffe_buffer *buf;
-	unsigned long size;
+	struct dev_data *dev = video_drvdata(file);
+	int ret;
 
-	dev = vb2_get_drv_priv(vb->vb2_queue);
-	buf = container_of(vb, struct ffe_buffer, vb);
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	ret = vidioc_try_fmt_vid_cap(file, priv, f);
+	if (ret < 0)
+		return ret;
 
-	if (dev->width < 48 || dev->width > MAX_WIDTH || dev->height < 32 || dev->height > MAX_HEIGHT) {
-		v4l2_err(&dev->v4l2_dev, "%s: width or/and height is/are not in expected range..\n", __func__);
-		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	if (ffe_is_busy(dev)) {
+		v4l2_err(&dev->v4l2_dev, "%s device busy..\n", __func__);
+		mutex_unlock(&dev->mutex);
+		return -EBUSY;
 	}
 
-	size = dev->width * dev->height * dev->pixelsize;
-	if (vb2_plane_size(vb, 0) < size) {
-		v4l2_err(&dev->v4l2_dev, "%s: data will not fit into the plane (%lu < %lu)..\n", __func__, vb2_plane_size(vb, 0), size);
-		return -EINVAL;
-	}
+	write_seqcount_begin(&dev->fmt_seq);
+	dev->fmt = get_format(f->fmt.pix.pixelformat);
+	dev->pixelsize = dev->fmt->depth / 8;
+	dev->width = f->fmt.pix.width;
+	dev->height = f->fmt.pix.height;
+	dev->colorspace = f->fmt.pix.colorspace;
+	dev->ycbcr_enc = f->fmt.pix.ycbcr_enc;
+	dev->quantization = f->fmt.pix.quantization;
+	dev->xfer_func = f->fmt.pix.xfer_func;
+	write_seqcount_end(&dev->fmt_seq);
+	dev->pattern_valid = false;
+	ret = ffe_prepare_pattern(dev);
+	mutex_unlock(&dev->mutex);
+	return ret;
+}
 
-	vb2_set_plane_payload(&buf->vb, 0, size);
-	generate_colorbar(dev);
-	return 0;
+/* The sizes try_fmt can return: tiled formats come in whole tiles in both planes */
+static void ffe_fmt_sizes(const struct ffe_fmt *fmt, struct v4l2_frmsize_stepwise *sizes)
+{
+	sizes->step_width = fmt->tile_w ? fmt->tile_w : 4;
+	sizes->step_height = fmt->tile_w ? 2 * fmt->tile_h : 1;
+	sizes->min_width = ALIGN(48, sizes->step_width);
+	sizes->max_width = rounddown(MAX_WIDTH, sizes->step_width);
+	sizes->min_height = ALIGN(32, sizes->step_height);
+	sizes->max_height = rounddown(MAX_HEIGHT, sizes->step_height);
 }
 
-static void buffer_queue(struct vb2_buffer *vb)
+static int vidioc_enum_framesizes(struct file *file, void *fh, struct v4l2_frmsizeenum *fsize)
 {
-	struct dev_data *dev;
-	struct ffe_buffer *buf;
-	struct ffe_dmaq *vidq;
-	unsigned long flags = 0;
+	struct dev_data *dev = video_drvdata(file);
+	const struct ffe_fmt *fmt;
 
-	dev = vb2_get_drv_priv(vb->vb2_queue);
-	buf = container_of(vb, struct ffe_buffer, vb);
-	vidq = &dev->vidq;
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-
-	spin_lock_irqsave(&dev->s_lock, flags);
-	list_add_tail(&buf->list, &vidq->active);
-	spin_unlock_irqrestore(&dev->s_lock, flags);
+	if (fsize->index)
+		return -EINVAL;
+	fmt = get_format(fsize->pixel_format);
+	if (!fmt)
+		return -EINVAL;
+	fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+	ffe_fmt_sizes(fmt, &fsize->stepwise);
+	return 0;
 }
 
-static int start_streaming(struct vb2_queue *vq, unsigned int count)
+static int vidioc_enum_input(struct file *file, void *priv, struct v4l2_input *inp)
 {
-	struct dev_data *dev;
-	int ret;
+	struct dev_data *dev = video_drvdata(file);
 
-	dev = vb2_get_drv_priv(vq);
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	dev->f_count = 0;
-
-	ret = ffe_start_generating(dev);
-	if (ret) {
-		struct ffe_buffer *buf, *tmp;
+	if (inp->index >= 1)
+		return -EINVAL;
 
-		list_for_each_entry_safe(buf, tmp, &dev->vidq.active, list) {
-			list_del(&buf->list);
-			vb2_buffer_done(&buf->vb, VB2_BUF_STATE_QUEUED);
-		}
-	}
-	return ret;
+	inp->type = V4L2_INPUT_TYPE_CAMERA;
+	sprintf(inp->name, "Camera %u", inp->index);
+	return 0;
 }
 
-static void stop_streaming(struct vb2_queue *vq)
+static int vidioc_g_input(struct file *file, void *priv, unsigned int *i)
 {
-	struct dev_data *dev;
+	struct dev_data *dev = video_drvdata(file);
 
-	dev = vb2_get_drv_priv(vq);
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	ffe_stop_generating(dev);
+	*i = READ_ONCE(dev->input);
+	return 0;
 }
 
-static void ffe_lock(struct vb2_queue *vq)
+static int vidioc_s_input(struct file *file, void *priv, unsigned int i)
 {
-	struct dev_data *dev = vb2_get_drv_priv(vq);
+	struct dev_data *dev = video_drvdata(file);
+	int ret;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	mutex_lock(&dev->mutex);
+	if (i >= 1)
+		return -EINVAL;
+
+	if (i == READ_ONCE(dev->input))
+		return 0;
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	dev->input = i;
+	dev->pattern_valid = false;
+	ret = ffe_prepare_pattern(dev);
+	mutex_unlock(&dev->mutex);
+	return ret;
 }
 
-static void ffe_unlock(struct vb2_queue *vq)
+static int vidioc_enum_frameintervals(struct file *file, void *priv, struct v4l2_frmivalenum *fival)
 {
-	struct dev_data *dev = vb2_get_drv_priv(vq);
+	const struct ffe_fmt *fmt;
+	struct v4l2_frmsize_stepwise sizes;
+	struct dev_data *dev = video_drvdata(file);
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	mutex_unlock(&dev->mutex);
-}
+	if (fival->index)
+		return -EINVAL;
 
-static const struct vb2_ops ffe_qops = {
-	.queue_setup			= queue_setup,
-	.buf_prepare			= buffer_prepare,
-	.buf_queue			= buffer_queue,
-	.start_streaming		= start_streaming,
-	.stop_streaming			= stop_streaming,
-	.wait_prepare			= ffe_unlock,
-	.wait_finish			= ffe_lock,
-};
+	fmt = get_format(fival->pixel_format);
+	if (!fmt)
+		return -EINVAL;
 
-static int vidioc_querycap(struct file *file, void  *priv, struct v4l2_capability *cap)
+	ffe_fmt_sizes(fmt, &sizes);
+	if (fival->width < sizes.min_width || fival->width > sizes.max_width ||
+	    fival->width % sizes.step_width)
+		return -EINVAL;
+
+	if (fival->height < sizes.min_height || fival->height > sizes.max_height ||
+	    fival->height % sizes.step_height)
+		return -EINVAL;
+
+	fival->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
+	fival->stepwise.min = tpf_min;
+	fival->stepwise.max = tpf_max;
+	fival->stepwise.step = (struct v4l2_fract) {1, 1};
+	return 0;
+}
+
+static int vidioc_g_parm(struct file *file, void *priv, struct v4l2_streamparm *parm)
 {
 	struct dev_data *dev = video_drvdata(file);
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	strcpy(cap->driver, KBUILD_MODNAME);
-	strcpy(cap->card, KBUILD_MODNAME);
-	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%s", dev->v4l2_dev.name);
-	cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
-	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	parm->parm.capture.capability   = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.capture.timeperframe = ffe_get_interval(dev);
+	parm->parm.capture.readbuffers  = 1;
 	return 0;
 }
 
-static int vidioc_enum_fmt_vid_cap(struct file *file, void *priv, struct v4l2_fmtdesc *f)
+static int vidioc_s_parm(struct file *file, void *priv, struct v4l2_streamparm *parm)
 {
-	const struct ffe_fmt *fmt;
+	struct v4l2_fract tpf;
 	struct dev_data *dev = video_drvdata(file);
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (f->index >= ARRAY_SIZE(formats))
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	fmt = &formats[f->index];
+	tpf = parm->parm.capture.timeperframe;
+	tpf = tpf.denominator ? tpf : tpf_default;
+	tpf = (u64)tpf.numerator * tpf_min.denominator < (u64)tpf_min.numerator * tpf.denominator ? tpf_min : tpf;
+	tpf = (u64)tpf.numerator * tpf_max.denominator > (u64)tpf_max.numerator * tpf.denominator ? tpf_max : tpf;
 
-	strlcpy(f->description, fmt->name, sizeof(f->description));
-	f->pixelformat = fmt->fourcc;
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	write_seqcount_begin(&dev->fmt_seq);
+	dev->time_per_frame = tpf;
+	write_seqcount_end(&dev->fmt_seq);
+	if (dev->vidq.kthread) {
+		WRITE_ONCE(dev->vidq.rebase, true);
+		wake_up_process(dev->vidq.kthread);
+	}
+	mutex_unlock(&dev->mutex);
+	parm->parm.capture.timeperframe = tpf;
+	parm->parm.capture.readbuffers = 1;
 	return 0;
 }
 
-static int vidioc_g_fmt_vid_cap(struct file *file, void *priv, struct v4l2_format *f)
+static int vidioc_log_status(struct file *file, void *priv)
 {
 	struct dev_data *dev = video_drvdata(file);
+	unsigned int mode = READ_ONCE(fill_mode);
+	struct ffe_consumer *cons;
+	unsigned int i = 0;
+	u64 mbps = 0;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	f->fmt.pix.width = dev->width;
-	f->fmt.pix.height = dev->height;
-	f->fmt.pix.field = V4L2_FIELD_INTERLACED;
-	f->fmt.pix.pixelformat = dev->fmt->fourcc;
-	f->fmt.pix.bytesperline = (f->fmt.pix.width * dev->fmt->depth) >> 3;
-	f->fmt.pix.sizeimage = f->fmt.pix.height * f->fmt.pix.bytesperline;
-	if (dev->fmt->is_yuv)
-		f->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
-	else
-		f->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+	v4l2_ctrl_log_status(file, priv);
+
+	/* the source and consumers change under the device lock, which QBUF and DQBUF do not take */
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	if (dev->fill_ns)
+		mbps = div64_u64(dev->fill_bytes * 1000, dev->fill_ns);
+	v4l2_info(&dev->v4l2_dev, "fill: %s, block %u KiB, %ux%u %s\n",
+		  mode < ARRAY_SIZE(fill_mode_names) ? fill_mode_names[mode] : "doubling",
+		  READ_ONCE(fill_block), dev->width, dev->height, dev->fmt->name);
+	v4l2_info(&dev->v4l2_dev, "fill: path %s, %u byte lines, zeroing %s\n", fill_path.name,
+		  fill_path.line, fill_path.line && READ_ONCE(fill_zero) ? "on" : "off");
+	v4l2_info(&dev->v4l2_dev, "fill: %u frames, %llu bytes in %llu ns (%llu MB/s)\n",
+		  dev->fill_frames, dev->fill_bytes, dev->fill_ns, mbps);
+	v4l2_info(&dev->v4l2_dev, "osd: %s, %llu ns per frame\n", dev->osd_ready ? "ready" : "unavailable",
+		  dev->fill_frames ? div_u64(dev->osd_ns, dev->fill_frames) : 0);
+	if (dev->src.filp) {
+		v4l2_info(&dev->v4l2_dev, "source: %s, streaming %u frames of %ux%u %s\n", dev->src.path,
+			  dev->src.n_frames, dev->src.width, dev->src.height, dev->src.fmt->name);
+		v4l2_info(&dev->v4l2_dev, "source: %u read ahead, %u hits, %u misses (frame repeated), %u read errors\n",
+			  dev->src.ra_size - 1, dev->src.ra_hits, dev->src.ra_misses, dev->src.ra_errors);
+	} else if (dev->src.n_frames) {
+		v4l2_info(&dev->v4l2_dev, "source: %s, %u frames of %ux%u %s\n", dev->src.path,
+			  dev->src.n_frames, dev->src.width, dev->src.height, dev->src.fmt->name);
+		v4l2_info(&dev->v4l2_dev, "source: %u cache slots, %u hits, %u misses, %u evictions, %llu us per conversion\n",
+			  dev->src.n_slots, dev->src.hits, dev->src.misses, dev->src.evictions,
+			  dev->src.misses ? div_u64(dev->src.convert_ns, dev->src.misses * NSEC_PER_USEC) : 0);
+		v4l2_info(&dev->v4l2_dev, "source: %llu KiB stored for %llu KiB of frames, lz4 %llu MB/s\n",
+			  dev->src.stored >> 10, ((u64)dev->src.n_frames * dev->src.frame_size) >> 10,
+			  dev->src.lz4_ns ? div64_u64(dev->src.lz4_bytes * 1000, dev->src.lz4_ns) : 0);
+	}
+	v4l2_info(&dev->v4l2_dev, "memory: %lu cache objects reclaimed\n", dev->reclaimed);
+	v4l2_info(&dev->v4l2_dev, "dmabuf: %u imported, %u mapped, %u maps reused\n", dev->n_imports,
+		  dev->import_maps, dev->import_hits);
+	ffe_mem_reap(dev, false);
+	v4l2_info(&dev->v4l2_dev, "memory: buffers %ld KiB, pattern %ld KiB, source %ld KiB, telemetry %ld KiB\n",
+		  atomic_long_read(&dev->mem[FFE_MEM_BUFFERS]) >> 10, atomic_long_read(&dev->mem[FFE_MEM_PATTERN]) >> 10,
+		  atomic_long_read(&dev->mem[FFE_MEM_SOURCE]) >> 10, atomic_long_read(&dev->mem[FFE_MEM_TELEMETRY]) >> 10);
+	v4l2_info(&dev->v4l2_dev, "stream: time to first frame %llu us\n", div_u64(dev->ttff_ns, NSEC_PER_USEC));
+	if (dev->hdr.exposures > 1)
+		v4l2_info(&dev->v4l2_dev, "hdr: %u exposures, %llu/%llu/%llu frames\n", dev->hdr.exposures,
+			  dev->hdr.frames[0], dev->hdr.frames[1], dev->hdr.frames[2]);
+	if (dev->vidq.virt)
+		v4l2_info(&dev->v4l2_dev, "clock: virtual, %lld ns, %d steps pending\n", ktime_to_ns(dev->vidq.next),
+			  atomic_read(&dev->vidq.steps));
+	if (dev->trace.n)
+		v4l2_info(&dev->v4l2_dev, "trace: %s, frame %u of %u, %u drops replayed\n", dev->trace.path,
+			  dev->trace.pos, dev->trace.n, dev->trace.drops);
+	v4l2_info(&dev->v4l2_dev, "stream: sequence %u, dropped %u, clock %s, %u suspends\n", dev->f_count, dev->dropped,
+		  READ_ONCE(dev->vidq.parked) ? "parked" : "running", dev->suspend_count);
+	v4l2_info(&dev->v4l2_dev, "consumers: %s, %u streaming\n", consumer_mode_names[dev->consumer_mode], dev->streaming);
+	list_for_each_entry(cons, &dev->vidq.consumers, node)
+		v4l2_info(&dev->v4l2_dev, "consumer %u: delivered %u, dropped %u\n", i++, cons->delivered, cons->dropped);
+	mutex_unlock(&dev->mutex);
 	return 0;
 }
 
-static int vidioc_try_fmt_vid_cap(struct file *file, void *priv, struct v4l2_format *f)
+static int ffe_open(struct file *file)
 {
 	struct dev_data *dev = video_drvdata(file);
-	const struct ffe_fmt *fmt;
+	struct ffe_fh *ffh;
+	int ret;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	fmt = get_format(f->fmt.pix.pixelformat);
-	if (!fmt) {
-		v4l2_err(&dev->v4l2_dev, "%s: Unknown format..\n", __func__);
-		f->fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-		fmt = get_format(f->fmt.pix.pixelformat);
+	if (dev->consumer_mode == FFE_CONSUMER_EXCLUSIVE) {
+		ret = v4l2_fh_open(file);
+		if (ret)
+			return ret;
+
+		mutex_lock(&dev->mutex);
+		if (!dev->queue_ready) {
+			ret = ffe_init_queue(dev, &dev->cons);
+			if (ret)
+				v4l2_err(&dev->v4l2_dev, "%s: vb2 queue init failed..\n", __func__);
+			else
+				dev->queue_ready = true;
+		}
+		if (!ret)
+			ret = ffe_prepare_pattern(dev);
+		mutex_unlock(&dev->mutex);
+
+		if (ret)
+			v4l2_fh_release(file);
+		return ret;
 	}
 
-	f->fmt.pix.field = V4L2_FIELD_INTERLACED;
-	f->fmt.pix.bytesperline = (f->fmt.pix.width * fmt->depth) >> 3;
-	f->fmt.pix.sizeimage = f->fmt.pix.height * f->fmt.pix.bytesperline;
-	if (fmt->is_yuv)
-		f->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
+	ffh = kzalloc(sizeof(*ffh), GFP_KERNEL_ACCOUNT);
+	if (!ffh)
+		return -ENOMEM;
+	v4l2_fh_init(&ffh->fh, &dev->vdev);
+
+	mutex_lock(&dev->mutex);
+	ret = ffe_init_queue(dev, &ffh->cons);
+	if (ret)
+		v4l2_err(&dev->v4l2_dev, "%s: vb2 queue init failed..\n", __func__);
 	else
-		f->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+		ret = ffe_prepare_pattern(dev);
+	mutex_unlock(&dev->mutex);
+
+	if (ret) {
+		v4l2_fh_exit(&ffh->fh);
+		kfree(ffh);
+		return ret;
+	}
+
+	file->private_data = &ffh->fh;
+	v4l2_fh_add(&ffh->fh);
 	return 0;
 }
 
-static int vidioc_s_fmt_vid_cap(struct file *file, void *priv, struct v4l2_format *f)
+static int ffe_release(struct file *file)
 {
 	struct dev_data *dev = video_drvdata(file);
-	struct vb2_queue *q = &dev->queue;
-	int ret;
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	struct ffe_fh *ffh;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	ret = vidioc_try_fmt_vid_cap(file, priv, f);
-	if (ret < 0)
-		return ret;
+	if (!cons)
+		return vb2_fop_release(file);
 
-	if (vb2_is_busy(q)) {
-		v4l2_err(&dev->v4l2_dev, "%s device busy..\n", __func__);
-		return -EBUSY;
-	}
+	mutex_lock(&cons->lock);
+	vb2_queue_release(&cons->queue);
+	mutex_unlock(&cons->lock);
 
-	dev->fmt = get_format(f->fmt.pix.pixelformat);
-	dev->pixelsize = dev->fmt->depth / 8;
-	dev->width = f->fmt.pix.width;
-	dev->height = f->fmt.pix.height;
+	ffh = container_of(cons, struct ffe_fh, cons);
+	v4l2_fh_del(&ffh->fh);
+	v4l2_fh_exit(&ffh->fh);
+	kfree(ffh);
 	return 0;
 }
 
-static int vidioc_enum_framesizes(struct file *file, void *fh, struct v4l2_frmsizeenum *fsize)
+static ssize_t ffe_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	ssize_t ret;
+
+	if (!cons)
+		return vb2_fop_read(file, buf, count, ppos);
+
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_read(&cons->queue, buf, count, ppos, file->f_flags & O_NONBLOCK);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
+
+static unsigned int ffe_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	unsigned int ret;
+
+	if (!cons)
+		return vb2_fop_poll(file, wait);
+
+	if (mutex_lock_interruptible(&cons->lock))
+		return POLLERR;
+	ret = vb2_poll(&cons->queue, file, wait);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
+
+static int ffe_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+
+	if (vma->vm_pgoff == FFE_TELEMETRY_OFFSET >> PAGE_SHIFT)
+		return ffe_telemetry_mmap(video_drvdata(file), vma);
+	if (!cons)
+		return vb2_fop_mmap(file, vma);
+	return vb2_mmap(&cons->queue, vma);
+}
+
+static const struct v4l2_file_operations ffe_fops = {
+	.owner				= THIS_MODULE,
+	.open				= ffe_open,
+	.release			= ffe_release,
+	.read				= ffe_read,
+	.poll				= ffe_poll,
+	.unlocked_ioctl			= video_ioctl2,
+	.mmap				= ffe_mmap,
+};
+
+/*
+ * Buffer ioctls go through the device queue helpers in exclusive mode, where
+ * the ioctl core takes the queue lock, and straight to the handle's own queue
+ * under its lock in broadcast mode. Neither takes dev->mutex.
+ */
+static int vidioc_reqbufs(struct file *file, void *priv, struct v4l2_requestbuffers *p)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
+
+	if (!cons)
+		return vb2_ioctl_reqbufs(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_reqbufs(&cons->queue, p);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
+
+static int vidioc_create_bufs(struct file *file, void *priv, struct v4l2_create_buffers *p)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
+
+	if (!cons)
+		return vb2_ioctl_create_bufs(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_create_bufs(&cons->queue, p);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
+
+static int vidioc_prepare_buf(struct file *file, void *priv, struct v4l2_buffer *p)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
+
+	if (!cons)
+		return vb2_ioctl_prepare_buf(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_prepare_buf(&cons->queue, p);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
+
+static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *p)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
+
+	if (!cons)
+		return vb2_ioctl_querybuf(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_querybuf(&cons->queue, p);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
+
+static int vidioc_expbuf(struct file *file, void *priv, struct v4l2_exportbuffer *p)
 {
-	struct dev_data *dev = video_drvdata(file);
-	static const struct v4l2_frmsize_stepwise sizes = {
-		48, MAX_WIDTH, 4, 32, MAX_HEIGHT, 1
-	};
-	int i;
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (fsize->index)
-		return -EINVAL;
-	for (i = 0; i < ARRAY_SIZE(formats); i++)
-		if (formats[i].fourcc == fsize->pixel_format)
-			break;
-	if (i == ARRAY_SIZE(formats))
-		return -EINVAL;
-	fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
-	fsize->stepwise = sizes;
-	return 0;
+	if (!cons)
+		return vb2_ioctl_expbuf(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_expbuf(&cons->queue, p);
+	mutex_unlock(&cons->lock);
+	return ret;
 }
 
-static int vidioc_enum_input(struct file *file, void *priv, struct v4l2_input *inp)
+static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
-	struct dev_data *dev = video_drvdata(file);
-
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (inp->index >= 1)
-		return -EINVAL;
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
 
-	inp->type = V4L2_INPUT_TYPE_CAMERA;
-	sprintf(inp->name, "Camera %u", inp->index);
-	return 0;
+	if (!cons)
+		return vb2_ioctl_qbuf(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_qbuf(&cons->queue, p);
+	mutex_unlock(&cons->lock);
+	return ret;
 }
 
-static int vidioc_g_input(struct file *file, void *priv, unsigned int *i)
+static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
-	struct dev_data *dev = video_drvdata(file);
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	*i = dev->input;
-	return 0;
+	if (!cons)
+		return vb2_ioctl_dqbuf(file, priv, p);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_dqbuf(&cons->queue, p, file->f_flags & O_NONBLOCK);
+	mutex_unlock(&cons->lock);
+	return ret;
 }
 
-static int vidioc_s_input(struct file *file, void *priv, unsigned int i)
+static int vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
 {
-	struct dev_data *dev = video_drvdata(file);
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (i >= 1)
-		return -EINVAL;
+	if (!cons)
+		return vb2_ioctl_streamon(file, priv, i);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_streamon(&cons->queue, i);
+	mutex_unlock(&cons->lock);
+	return ret;
+}
 
-	if (i == dev->input)
-		return 0;
+static int vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
+{
+	struct ffe_consumer *cons = ffe_fh_consumer(file);
+	int ret;
 
-	dev->input = i;
-	generate_colorbar(dev);
-	return 0;
+	if (!cons)
+		return vb2_ioctl_streamoff(file, priv, i);
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	ret = vb2_streamoff(&cons->queue, i);
+	mutex_unlock(&cons->lock);
+	return ret;
 }
 
-static int vidioc_enum_frameintervals(struct file *file, void *priv, struct v4l2_frmivalenum *fival)
+static int ffe_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_FRAME_SYNC:
+		return v4l2_event_subscribe(fh, sub, 0, NULL);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
+static int ffe_get_fence(struct file *file, struct ffe_fence *f)
 {
-	const struct ffe_fmt *fmt;
 	struct dev_data *dev = video_drvdata(file);
+	struct ffe_consumer *cons = ffe_fh_consumer(file) ? : &dev->cons;
+	struct dma_fence *fence = NULL;
+	struct sync_file *sync;
+	struct ffe_buffer *buf;
+	unsigned long flags = 0;
+	int fd;
 
 	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (fival->index)
+	if (f->reserved[0] || f->reserved[1])
 		return -EINVAL;
 
-	fmt = get_format(fival->pixel_format);
-	if (!fmt)
-		return -EINVAL;
+	/* the queue lock keeps the buffers allocated, s_lock the fence */
+	if (mutex_lock_interruptible(&cons->lock))
+		return -ERESTARTSYS;
+	spin_lock_irqsave(&dev->s_lock, flags);
+	if (f->index < cons->queue.num_buffers) {
+		buf = container_of(cons->queue.bufs[f->index], struct ffe_buffer, vb.vb2_buf);
+		if (buf->fence)
+			fence = dma_fence_get(buf->fence);
+	}
+	spin_unlock_irqrestore(&dev->s_lock, flags);
+	mutex_unlock(&cons->lock);
+	if (!fence) {
+		v4l2_err(&dev->v4l2_dev, "%s: buffer %u is not queued..\n", __func__, f->index);
+		return -ENOENT;
+	}
 
-	if (fival->width < 48 || fival->width > MAX_WIDTH || (fival->width & 3))
-		return -EINVAL;
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		dma_fence_put(fence);
+		return fd;
+	}
 
-	if (fival->height < 32 || fival->height > MAX_HEIGHT)
-		return -EINVAL;
+	sync = sync_file_create(fence);
+	dma_fence_put(fence);
+	if (!sync) {
+		put_unused_fd(fd);
+		return -ENOMEM;
+	}
 
-	fival->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
-	fival->stepwise.min = tpf_min;
-	fival->stepwise.max = tpf_max;
-	fival->stepwise.step = (struct v4l2_fract) {1, 1};
+	fd_install(fd, sync->file);
+	f->fd = fd;
 	return 0;
 }
 
-static int vidioc_g_parm(struct file *file, void *priv, struct v4l2_streamparm *parm)
+#define FFE_STEP_MAX			(1 << 20)
+
+static int ffe_step(struct file *file, struct ffe_step *step)
 {
 	struct dev_data *dev = video_drvdata(file);
+	struct ffe_dmaq *q = &dev->vidq;
+	int ret = 0;
 
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+	v4l2_info(&dev->v4l2_dev, "%s: %u frames\n", __func__, step->frames);
+	if (step->reserved[0] || step->reserved[1] || step->reserved[2])
 		return -EINVAL;
 
-	parm->parm.capture.capability   = V4L2_CAP_TIMEPERFRAME;
-	parm->parm.capture.timeperframe = dev->time_per_frame;
-	parm->parm.capture.readbuffers  = 1;
-	return 0;
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	if (!q->kthread || !q->virt) {
+		v4l2_err(&dev->v4l2_dev, "%s: not streaming on the virtual clock..\n", __func__);
+		ret = -EINVAL;
+	} else if (!step->frames || step->frames > FFE_STEP_MAX - atomic_read(&q->steps)) {
+		ret = -EINVAL;
+	} else {
+		atomic_add(step->frames, &q->steps);
+		wake_up_interruptible(&q->wq);
+	}
+	mutex_unlock(&dev->mutex);
+	return ret;
 }
 
-static int vidioc_s_parm(struct file *file, void *priv, struct v4l2_streamparm *parm)
+static long vidioc_default(struct file *file, void *priv, bool valid_prio, unsigned int cmd, void *arg)
 {
-	struct v4l2_fract tpf;
-	struct dev_data *dev = video_drvdata(file);
-
-	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
-	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-		return -EINVAL;
-
-	tpf = parm->parm.capture.timeperframe;
-	tpf = tpf.denominator ? tpf : tpf_default;
-	tpf = (u64)tpf.numerator * tpf_min.denominator < (u64)tpf_min.numerator * tpf.denominator ? tpf_min : tpf;
-	tpf = (u64)tpf.numerator * tpf_max.denominator > (u64)tpf_max.numerator * tpf.denominator ? tpf_max : tpf;
-
-	dev->time_per_frame = tpf;
-	parm->parm.capture.timeperframe = tpf;
-	parm->parm.capture.readbuffers = 1;
-	return 0;
+	switch (cmd) {
+	case FFE_IOC_G_FENCE:
+		return ffe_get_fence(file, arg);
+	case FFE_IOC_STEP:
+		return ffe_step(file, arg);
+	default:
+		return -ENOTTY;
+	}
 }
 
-static const struct v4l2_file_operations ffe_fops = {
-	.owner				= THIS_MODULE,
-	.open				= v4l2_fh_open,
-	.release			= vb2_fop_release,
-	.read				= vb2_fop_read,
-	.poll				= vb2_fop_poll,
-	.unlocked_ioctl			= video_ioctl2,
-	.mmap				= vb2_fop_mmap,
-};
-
 static const struct v4l2_ioctl_ops ffe_ioctl_ops = {
 	.vidioc_querycap		= vidioc_querycap,
 	.vidioc_enum_fmt_vid_cap	= vidioc_enum_fmt_vid_cap,
@@ -873,30 +4194,473 @@ static const struct v4l2_ioctl_ops ffe_ioctl_ops = {
 	.vidioc_try_fmt_vid_cap		= vidioc_try_fmt_vid_cap,
 	.vidioc_s_fmt_vid_cap		= vidioc_s_fmt_vid_cap,
 	.vidioc_enum_framesizes		= vidioc_enum_framesizes,
-	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
-	.vidioc_create_bufs		= vb2_ioctl_create_bufs,
-	.vidioc_prepare_buf		= vb2_ioctl_prepare_buf,
-	.vidioc_querybuf		= vb2_ioctl_querybuf,
-	.vidioc_qbuf			= vb2_ioctl_qbuf,
-	.vidioc_dqbuf			= vb2_ioctl_dqbuf,
+	.vidioc_reqbufs			= vidioc_reqbufs,
+	.vidioc_create_bufs		= vidioc_create_bufs,
+	.vidioc_prepare_buf		= vidioc_prepare_buf,
+	.vidioc_querybuf		= vidioc_querybuf,
+	.vidioc_expbuf			= vidioc_expbuf,
+	.vidioc_qbuf			= vidioc_qbuf,
+	.vidioc_dqbuf			= vidioc_dqbuf,
 	.vidioc_enum_input		= vidioc_enum_input,
 	.vidioc_g_input			= vidioc_g_input,
 	.vidioc_s_input			= vidioc_s_input,
 	.vidioc_enum_frameintervals	= vidioc_enum_frameintervals,
 	.vidioc_g_parm			= vidioc_g_parm,
 	.vidioc_s_parm			= vidioc_s_parm,
-	.vidioc_streamon		= vb2_ioctl_streamon,
-	.vidioc_streamoff		= vb2_ioctl_streamoff,
-	.vidioc_log_status		= v4l2_ctrl_log_status,
-	.vidioc_subscribe_event		= v4l2_ctrl_subscribe_event,
+	.vidioc_streamon		= vidioc_streamon,
+	.vidioc_streamoff		= vidioc_streamoff,
+	.vidioc_log_status		= vidioc_log_status,
+	.vidioc_subscribe_event		= ffe_subscribe_event,
 	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
+	.vidioc_default			= vidioc_default,
+};
+
+#define FFE_CID_CUSTOM_BASE		(V4L2_CID_USER_BASE | 0xf000)
+#define FFE_CID_OSD_MODE		(FFE_CID_CUSTOM_BASE + 0)
+#define FFE_CID_OSD_TEXT		(FFE_CID_CUSTOM_BASE + 1)
+#define FFE_CID_SRC_FILE		(FFE_CID_CUSTOM_BASE + 2)
+#define FFE_CID_SRC_FORMAT		(FFE_CID_CUSTOM_BASE + 3)
+#define FFE_CID_SRC_WIDTH		(FFE_CID_CUSTOM_BASE + 4)
+#define FFE_CID_SRC_HEIGHT		(FFE_CID_CUSTOM_BASE + 5)
+#define FFE_CID_SRC_COLORIMETRY		(FFE_CID_CUSTOM_BASE + 6)
+#define FFE_CID_TRACE_FILE		(FFE_CID_CUSTOM_BASE + 7)
+#define FFE_CID_HDR_EXPOSURES		(FFE_CID_CUSTOM_BASE + 8)
+#define FFE_CID_LAYOUT			(FFE_CID_CUSTOM_BASE + 9)
+#define FFE_CID_SENSORS			(FFE_CID_CUSTOM_BASE + 10)
+#define FFE_CID_DISPARITY		(FFE_CID_CUSTOM_BASE + 11)
+#define FFE_CID_DEPTH_PATTERN		(FFE_CID_CUSTOM_BASE + 12)
+
+static int ffe_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct dev_data *dev = container_of(ctrl->handler, struct dev_data, ctrl_handler);
+	unsigned long flags = 0;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	switch (ctrl->id) {
+	case FFE_CID_OSD_MODE:
+		WRITE_ONCE(dev->osd_mode, ctrl->val);
+		break;
+	case FFE_CID_OSD_TEXT:
+		spin_lock_irqsave(&dev->s_lock, flags);
+		strlcpy(dev->osd_text, ctrl->p_new.p_char, sizeof(dev->osd_text));
+		spin_unlock_irqrestore(&dev->s_lock, flags);
+		break;
+	case FFE_CID_SRC_FILE:
+	case FFE_CID_SRC_FORMAT:
+	case FFE_CID_SRC_WIDTH:
+	case FFE_CID_SRC_HEIGHT:
+	case FFE_CID_SRC_COLORIMETRY:
+		/* the generator reads the clip without the control lock */
+		if (dev->streaming)
+			return -EBUSY;
+		if (ctrl->id == FFE_CID_SRC_FILE)
+			strlcpy(dev->src.path, ctrl->p_new.p_char, sizeof(dev->src.path));
+		else if (ctrl->id == FFE_CID_SRC_FORMAT)
+			dev->src.fmt = &formats[ctrl->val];
+		else if (ctrl->id == FFE_CID_SRC_WIDTH)
+			dev->src.width = ctrl->val;
+		else if (ctrl->id == FFE_CID_SRC_HEIGHT)
+			dev->src.height = ctrl->val;
+		else
+			dev->src.colorimetry = ctrl->val;
+		/* only the converted frames depend on the colorimetry */
+		dev->src.stale |= ctrl->id != FFE_CID_SRC_COLORIMETRY;
+		dev->pattern_valid = false;
+		break;
+	case FFE_CID_TRACE_FILE:
+		if (dev->streaming)
+			return -EBUSY;
+		return ffe_trace_load(dev, ctrl->p_new.p_char);
+	case FFE_CID_HDR_EXPOSURES:
+		if (dev->streaming)
+			return -EBUSY;
+		/* buffers may already be queued, so build the lines now unless nothing was opened yet */
+		dev->hdr.exposures = ctrl->val;
+		dev->pattern_valid = false;
+		return dev->line ? ffe_prepare_pattern(dev) : 0;
+	case FFE_CID_LAYOUT:
+		WRITE_ONCE(dev->comp.layout, ctrl->val);
+		break;
+	case FFE_CID_SENSORS:
+		WRITE_ONCE(dev->comp.sensors, ctrl->val);
+		break;
+	case FFE_CID_DISPARITY:
+		WRITE_ONCE(dev->comp.disparity, ctrl->val);
+		break;
+	case FFE_CID_DEPTH_PATTERN:
+		WRITE_ONCE(dev->depth.pattern, ctrl->val);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops ffe_ctrl_ops = {
+	.s_ctrl				= ffe_s_ctrl,
+};
+
+static const char * const osd_mode_menu[] = {
+	"Off",
+	"Sequence and Timestamp",
+	"Text",
+	"Sequence, Timestamp and Text",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_osd_mode = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_OSD_MODE,
+	.name				= "OSD Mode",
+	.type				= V4L2_CTRL_TYPE_MENU,
+	.max				= FFE_OSD_ALL,
+	.def				= FFE_OSD_OFF,
+	.qmenu				= osd_mode_menu,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_osd_text = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_OSD_TEXT,
+	.name				= "OSD Text",
+	.type				= V4L2_CTRL_TYPE_STRING,
+	.max				= OSD_TEXT_MAX,
+	.step				= 1,
+};
+
+/* filled from formats[] by ffe_init_controls() */
+static const char *src_format_menu[ARRAY_SIZE(formats) + 1];
+
+static const struct v4l2_ctrl_config ffe_ctrl_src_file = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_SRC_FILE,
+	.name				= "Source File",
+	.type				= V4L2_CTRL_TYPE_STRING,
+	.max				= FFE_SRC_PATH_MAX,
+	.step				= 1,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_src_format = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_SRC_FORMAT,
+	.name				= "Source Format",
+	.type				= V4L2_CTRL_TYPE_MENU,
+	.max				= ARRAY_SIZE(formats) - 1,
+	.def				= 0,
+	.qmenu				= src_format_menu,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_src_width = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_SRC_WIDTH,
+	.name				= "Source Width",
+	.type				= V4L2_CTRL_TYPE_INTEGER,
+	.min				= 2,
+	.max				= MAX_WIDTH,
+	.step				= 2,
+	.def				= 640,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_src_height = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_SRC_HEIGHT,
+	.name				= "Source Height",
+	.type				= V4L2_CTRL_TYPE_INTEGER,
+	.min				= 1,
+	.max				= MAX_HEIGHT,
+	.step				= 1,
+	.def				= 360,
+};
+
+/* in csc_matrices[] order */
+static const char * const src_colorimetry_menu[] = {
+	"BT.601 Limited Range",
+	"BT.601 Full Range",
+	"BT.709 Limited Range",
+	"BT.709 Full Range",
+	"BT.2020 Limited Range",
+	"BT.2020 Full Range",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_src_colorimetry = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_SRC_COLORIMETRY,
+	.name				= "Source Colorimetry",
+	.type				= V4L2_CTRL_TYPE_MENU,
+	.max				= ARRAY_SIZE(csc_matrices) - 1,
+	.def				= 0,
+	.qmenu				= src_colorimetry_menu,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_trace_file = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_TRACE_FILE,
+	.name				= "Timing Trace",
+	.type				= V4L2_CTRL_TYPE_STRING,
+	.max				= FFE_SRC_PATH_MAX,
+	.step				= 1,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_hdr_exposures = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_HDR_EXPOSURES,
+	.name				= "HDR Exposures",
+	.type				= V4L2_CTRL_TYPE_INTEGER,
+	.min				= 1,
+	.max				= FFE_HDR_MAX,
+	.step				= 1,
+	.def				= 1,
+};
+
+static const char * const layout_menu[] = {
+	"Mono",
+	"Side by Side",
+	"Top Bottom",
+	"Tiled",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_layout = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_LAYOUT,
+	.name				= "Sensor Layout",
+	.type				= V4L2_CTRL_TYPE_MENU,
+	.max				= FFE_LAYOUT_TILED,
+	.def				= FFE_LAYOUT_MONO,
+	.qmenu				= layout_menu,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_sensors = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_SENSORS,
+	.name				= "Tiled Sensors",
+	.type				= V4L2_CTRL_TYPE_INTEGER,
+	.min				= 2,
+	.max				= FFE_SENSORS_MAX,
+	.step				= 1,
+	.def				= FFE_SENSORS_MAX,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_disparity = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_DISPARITY,
+	.name				= "Disparity",
+	.type				= V4L2_CTRL_TYPE_INTEGER,
+	.min				= 0,
+	.max				= MAX_WIDTH / 4,
+	.step				= 2,
+	.def				= 16,
+};
+
+static const char * const depth_pattern_menu[] = {
+	"Ramp",
+	"Plane",
+	"Moving Object",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config ffe_ctrl_depth_pattern = {
+	.ops				= &ffe_ctrl_ops,
+	.id				= FFE_CID_DEPTH_PATTERN,
+	.name				= "Depth Pattern",
+	.type				= V4L2_CTRL_TYPE_MENU,
+	.max				= FFE_DEPTH_OBJECT,
+	.def				= FFE_DEPTH_RAMP,
+	.qmenu				= depth_pattern_menu,
+};
+
+static int ffe_init_controls(struct dev_data *dev)
+{
+	struct v4l2_ctrl_handler *hdl = &dev->ctrl_handler;
+	int i, ret;
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	for (i = 0; i < ARRAY_SIZE(formats); i++)
+		src_format_menu[i] = formats[i].name;
+
+	v4l2_ctrl_handler_init(hdl, 13);
+	/* controls serialise with the format and source ioctls */
+	hdl->lock = &dev->mutex;
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_osd_mode, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_osd_text, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_src_file, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_src_format, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_src_width, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_src_height, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_src_colorimetry, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_trace_file, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_hdr_exposures, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_layout, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_sensors, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_disparity, NULL);
+	v4l2_ctrl_new_custom(hdl, &ffe_ctrl_depth_pattern, NULL);
+	ret = hdl->error ? : v4l2_ctrl_handler_setup(hdl);
+	if (ret) {
+		v4l2_ctrl_handler_free(hdl);
+		return ret;
+	}
+
+	dev->v4l2_dev.ctrl_handler = hdl;
+	return 0;
+}
+
+/* /sys/devices/platform/<dev>/memory/<type>: bytes held per ffe_mem_type */
+static ssize_t ffe_mem_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	struct dev_data *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%ld\n", atomic_long_read(&dev->mem[(uintptr_t)ea->var]));
+}
+
+static struct dev_ext_attribute ffe_mem_attrs[] = {
+	[FFE_MEM_BUFFERS]		= { __ATTR(buffers, 0444, ffe_mem_show, NULL), (void *)FFE_MEM_BUFFERS },
+	[FFE_MEM_PATTERN]		= { __ATTR(pattern, 0444, ffe_mem_show, NULL), (void *)FFE_MEM_PATTERN },
+	[FFE_MEM_SOURCE]		= { __ATTR(source, 0444, ffe_mem_show, NULL), (void *)FFE_MEM_SOURCE },
+	[FFE_MEM_TELEMETRY]		= { __ATTR(telemetry, 0444, ffe_mem_show, NULL), (void *)FFE_MEM_TELEMETRY },
+};
+
+static struct attribute *ffe_mem_attr_list[] = {
+	&ffe_mem_attrs[FFE_MEM_BUFFERS].attr.attr,
+	&ffe_mem_attrs[FFE_MEM_PATTERN].attr.attr,
+	&ffe_mem_attrs[FFE_MEM_SOURCE].attr.attr,
+	&ffe_mem_attrs[FFE_MEM_TELEMETRY].attr.attr,
+	NULL,
+};
+
+static const struct attribute_group ffe_mem_group = {
+	.name				= "memory",
+	.attrs				= ffe_mem_attr_list,
+};
+
+/* /sys/devices/platform/<dev>/cache/: conversion cache and reclaim counters */
+#define FFE_CACHE_ATTR(_name, _field)							\
+static ssize_t _name##_show(struct device *d, struct device_attribute *attr, char *buf)	\
+{											\
+	struct dev_data *dev = dev_get_drvdata(d);					\
+											\
+	return sprintf(buf, "%lu\n", (unsigned long)READ_ONCE(dev->_field));		\
+}											\
+static DEVICE_ATTR_RO(_name)
+
+FFE_CACHE_ATTR(hits, src.hits);
+FFE_CACHE_ATTR(misses, src.misses);
+FFE_CACHE_ATTR(evictions, src.evictions);
+FFE_CACHE_ATTR(reclaimed, reclaimed);
+
+static struct attribute *ffe_cache_attr_list[] = {
+	&dev_attr_hits.attr,
+	&dev_attr_misses.attr,
+	&dev_attr_evictions.attr,
+	&dev_attr_reclaimed.attr,
+	NULL,
 };
 
+static const struct attribute_group ffe_cache_group = {
+	.name				= "cache",
+	.attrs				= ffe_cache_attr_list,
+};
+
+/*
+ * Cache reclaim. Converted source frames go least recently used first at any
+ * time, they are converted again on the next miss. The OSD atlas and the HDR
+ * exposure lines go only while no queue has buffers, the next QBUF, S_FMT or
+ * STREAMON rebuilds them. One object is one cached frame, atlas or line. Both locks
+ * are only tried, so reclaim never waits on a frame being filled.
+ */
+static unsigned long ffe_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct dev_data *dev = container_of(shrinker, struct dev_data, shrinker);
+	unsigned long n = 0;
+	unsigned int i;
+
+	for (i = 0; i < FFE_SRC_CACHE_MAX; i++)
+		n += !!READ_ONCE(dev->src.cache[i].buf);
+	if (!ffe_is_busy(dev)) {
+		n += !!READ_ONCE(dev->osd_atlas);
+		for (i = 0; i < FFE_HDR_MAX; i++)
+			n += !!READ_ONCE(dev->hdr.line[i]);
+	}
+	return n;
+}
+
+static bool ffe_shrink_source(struct dev_data *dev)
+{
+	struct ffe_source *src = &dev->src;
+	struct ffe_src_slot *slot = NULL;
+	size_t size = ffe_image_size(dev->fmt, dev->width, dev->height);
+	unsigned int i;
+
+	for (i = 0; i < FFE_SRC_CACHE_MAX; i++) {
+		if (!src->cache[i].buf)
+			continue;
+		if (!slot || src->cache[i].frame == -1 || (int)(src->cache[i].used - slot->used) < 0)
+			slot = &src->cache[i];
+		if (slot->frame == -1)
+			break;
+	}
+	if (!slot)
+		return false;
+
+	kvfree(slot->buf);
+	slot->buf = NULL;
+	slot->frame = -1;
+	src->cache_bytes -= size;
+	ffe_mem_account(dev, FFE_MEM_SOURCE, -(long)size);
+	return true;
+}
+
+static bool ffe_shrink_pattern(struct dev_data *dev)
+{
+	unsigned int e;
+
+	if (dev->osd_atlas) {
+		dev->osd_ready = false;
+		kvfree(dev->osd_atlas);
+		dev->osd_atlas = NULL;
+		ffe_mem_account(dev, FFE_MEM_PATTERN, -(long)(OSD_GLYPHS * OSD_FONT_H * OSD_FONT_W * 4));
+		dev->pattern_valid = false;
+		return true;
+	}
+
+	for (e = 0; e < FFE_HDR_MAX; e++) {
+		if (!dev->hdr.line[e])
+			continue;
+		devm_kfree(&dev->pdev->dev, dev->hdr.line[e]);
+		dev->hdr.line[e] = NULL;
+		ffe_mem_account(dev, FFE_MEM_PATTERN, -(MAX_WIDTH * 8));
+		dev->pattern_valid = false;
+		return true;
+	}
+	return false;
+}
+
+static unsigned long ffe_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct dev_data *dev = container_of(shrinker, struct dev_data, shrinker);
+	unsigned long freed = 0;
+
+	if (!mutex_trylock(&dev->mutex))
+		return SHRINK_STOP;
+
+	if (mutex_trylock(&dev->gen_lock)) {
+		while (freed < sc->nr_to_scan && ffe_shrink_source(dev))
+			freed++;
+		mutex_unlock(&dev->gen_lock);
+	}
+
+	while (!ffe_is_busy(dev) && freed < sc->nr_to_scan && ffe_shrink_pattern(dev))
+		freed++;
+	dev->reclaimed += freed;
+	mutex_unlock(&dev->mutex);
+
+	return freed ? : SHRINK_STOP;
+}
+
 static int p_probe(struct platform_device *pdev)
 {
 	struct dev_data *dev;
 	struct video_device *vdev;
-	struct vb2_queue *q;
 	int ret;
 
 	dev_info(&pdev->dev, "%s\n", __func__);
@@ -914,31 +4678,43 @@ static int p_probe(struct platform_device *pdev)
 
 	dev->fmt = &formats[0];
 	dev->time_per_frame = tpf_default;
+	dev->hdr.exposures = 1;
 	dev->width = 640;
 	dev->height = 360;
-	dev->pixelsize = dev->fmt->depth/2;
+	dev->pixelsize = dev->fmt->depth / 8;
+	dev->colorspace = V4L2_COLORSPACE_SMPTE170M;
+	dev->ycbcr_enc = V4L2_YCBCR_ENC_601;
+	dev->quantization = V4L2_QUANTIZATION_LIM_RANGE;
+	dev->xfer_func = V4L2_XFER_FUNC_709;
 
-	spin_lock_init(&dev->s_lock);
+	dev->consumer_mode = consumer_mode < ARRAY_SIZE(consumer_mode_names) ? consumer_mode : FFE_CONSUMER_EXCLUSIVE;
 
-	q = &dev->queue;
-	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	q->io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ;
-	q->drv_priv = dev;
-	q->buf_struct_size = sizeof(struct ffe_buffer);
-	q->ops = &ffe_qops;
-	q->mem_ops = &vb2_vmalloc_memops;
-	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	spin_lock_init(&dev->s_lock);
+	spin_lock_init(&dev->fence_lock);
+	spin_lock_init(&dev->src.ra_lock);
+	INIT_WORK(&dev->src.ra_work, ffe_readahead_work);
+	mutex_init(&dev->mutex);
+	mutex_init(&dev->gen_lock);
+	mutex_init(&dev->import_lock);
+	INIT_LIST_HEAD(&dev->imports);
+	spin_lock_init(&dev->exports_lock);
+	INIT_LIST_HEAD(&dev->exports);
+	seqcount_init(&dev->fmt_seq);
+	INIT_LIST_HEAD(&dev->vidq.consumers);
+	init_waitqueue_head(&dev->vidq.wq);
 
-	ret = vb2_queue_init(q);
+	ret = ffe_init_controls(dev);
 	if (ret) {
-		dev_err(&pdev->dev, "%s: vb2 queue init failed..\n", __func__);
+		dev_err(&pdev->dev, "%s: control handler init failed..\n", __func__);
 		v4l2_device_unregister(&dev->v4l2_dev);
 		return ret;
 	}
 
-	mutex_init(&dev->mutex);
-	INIT_LIST_HEAD(&dev->vidq.active);
-	init_waitqueue_head(&dev->vidq.wq);
+	ffe_telemetry_init(dev);
+
+	/* accounting only, the device works without it */
+	if (devm_device_add_group(&pdev->dev, &ffe_mem_group) || devm_device_add_group(&pdev->dev, &ffe_cache_group))
+		dev_warn(&pdev->dev, "%s: memory attributes not created\n", __func__);
 
 	vdev = &dev->vdev;
 	strlcpy(vdev->name, KBUILD_MODNAME, sizeof(vdev->name));
@@ -946,18 +4722,30 @@ static int p_probe(struct platform_device *pdev)
 	vdev->fops = &ffe_fops;
 	vdev->ioctl_ops = &ffe_ioctl_ops;
 	vdev->v4l2_dev = &dev->v4l2_dev;
-	vdev->queue = q;
-	vdev->lock = &dev->mutex;
+	/* vb2_queue_init() is deferred to the first open */
+	if (dev->consumer_mode == FFE_CONSUMER_EXCLUSIVE)
+		vdev->queue = &dev->cons.queue;
+	/* no core lock: queue ioctls take the queue lock, the rest lock as they need */
+	vdev->lock = NULL;
 	video_set_drvdata(vdev, dev);
 
 	ret = video_register_device(vdev, VFL_TYPE_GRABBER, -1);
 	if (ret < 0) {
 		dev_err(&pdev->dev, "%s: video device registration failed..\n", __func__);
+		v4l2_ctrl_handler_free(&dev->ctrl_handler);
 		v4l2_device_unregister(&dev->v4l2_dev);
 		video_device_release(&dev->vdev);
 		return ret;
 	}
 
+	/* without it caches are only freed with the device */
+	dev->shrinker.count_objects = ffe_shrink_count;
+	dev->shrinker.scan_objects = ffe_shrink_scan;
+	dev->shrinker.seeks = DEFAULT_SEEKS;
+	dev->shrinker_registered = !register_shrinker(&dev->shrinker);
+	if (!dev->shrinker_registered)
+		dev_warn(&pdev->dev, "%s: cache shrinker not registered\n", __func__);
+
 	v4l2_info(&dev->v4l2_dev, "%s: V4L2 device registered as %s\n", __func__, video_device_node_name(vdev));
 	return 0;
 }
@@ -969,36 +4757,102 @@ static int p_remove(struct platform_device *pdev)
 	dev_info(&pdev->dev, "%s\n", __func__);
 	dev = platform_get_drvdata(pdev);
 	v4l2_info(&dev->v4l2_dev, "%s: unregistering %s\n", __func__, video_device_node_name(&dev->vdev));
+	if (dev->shrinker_registered)
+		unregister_shrinker(&dev->shrinker);
 	video_unregister_device(&dev->vdev);
+	v4l2_ctrl_handler_free(&dev->ctrl_handler);
 	v4l2_device_unregister(&dev->v4l2_dev);
+	kvfree(dev->osd_atlas);
+	ffe_source_free(dev);
+	ffe_import_flush(dev);
+	ffe_mem_reap(dev, true);
+	vfree(dev->telemetry);
+	vfree(dev->trace.recs);
+	return 0;
+}
+
+/*
+ * The generator kthread is freezable, so it is already parked by the freezer
+ * when these run. Resume only asks it to rebase its frame clock, keeping the
+ * sequence contiguous and starting pacing and timestamps afresh.
+ */
+static int __maybe_unused ffe_suspend(struct device *d)
+{
+	struct dev_data *dev = dev_get_drvdata(d);
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	mutex_lock(&dev->mutex);
+	if (dev->vidq.kthread)
+		dev->suspend_count++;
+	mutex_unlock(&dev->mutex);
+	return 0;
+}
+
+static int __maybe_unused ffe_resume(struct device *d)
+{
+	struct dev_data *dev = dev_get_drvdata(d);
+
+	v4l2_info(&dev->v4l2_dev, "%s\n", __func__);
+	mutex_lock(&dev->mutex);
+	if (dev->vidq.kthread)
+		WRITE_ONCE(dev->vidq.rebase, true);
+	mutex_unlock(&dev->mutex);
 	return 0;
 }
 
+static SIMPLE_DEV_PM_OPS(ffe_pm_ops, ffe_suspend, ffe_resume);
+
 static struct platform_driver p_driver = {
 	.probe = p_probe,
 	.remove = p_remove,
 	.driver = {
 		.name = KBUILD_MODNAME,
 		.owner = THIS_MODULE,
+		.pm = &ffe_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 };
 
+static void ffe_unregister_devices(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_DEVS; i++) {
+		if (p_devices[i]) {
+			platform_device_unregister(p_devices[i]);
+			p_devices[i] = NULL;
+		}
+	}
+}
+
 static int __init ffe_v4l2_init(void)
 {
-	int ret;
+	int ret, i;
 
 	pr_info("%s\n", __func__);
+	ffe_select_fill_path();
 
-	ret = platform_device_register(&p_device);
-	if (ret) {
-		pr_err("%s: platform device, %s registration failed..\n", __func__, p_device.name);
-		return ret;
+	if (!n_devs || n_devs > MAX_DEVS) {
+		pr_err("%s: n_devs must be within 1..%d\n", __func__, MAX_DEVS);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < n_devs; i++) {
+		p_devices[i] = platform_device_register_simple(KBUILD_MODNAME, n_devs == 1 ? PLATFORM_DEVID_NONE : i, NULL, 0);
+		if (IS_ERR(p_devices[i])) {
+			ret = PTR_ERR(p_devices[i]);
+			p_devices[i] = NULL;
+			pr_err("%s: platform device, %s.%d registration failed..\n", __func__, KBUILD_MODNAME, i);
+			ffe_unregister_devices();
+			return ret;
+		}
 	}
 
 	ret = platform_driver_register(&p_driver);
 	if (ret) {
 		pr_err("%s: platform driver, %s registration failed..\n", __func__, p_driver.driver.name);
-		platform_device_unregister(&p_device);
+		ffe_unregister_devices();
+		return ret;
 	}
 	pr_info("FFE-V4L2-Driver version %s loaded successfully..\n", VERSION);
 	return ret;
@@ -1009,7 +4863,7 @@ static void __exit ffe_v4l2_exit(void)
 	pr_info("%s\n", __func__);
 
 	platform_driver_unregister(&p_driver);
-	platform_device_unregister(&p_device);
+	ffe_unregister_devices();
 }
 
 module_init(ffe_v4l2_init);
@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+
+/*
+ * V4L2 driver with Frame Feed Emulator - private ioctls
+ */
+
+#ifndef _FFE_V4L2_H
+#define _FFE_V4L2_H
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/**
+ * struct ffe_fence - completion fence of a queued capture buffer
+ * @index:	buffer index as passed to VIDIOC_QBUF
+ * @fd:		returned sync_file, signalled once the frame is in the buffer
+ *		and in error if the buffer is returned without a frame
+ * @reserved:	must be zero
+ */
+struct ffe_fence {
+	__u32				index;
+	__s32				fd;
+	__u32				reserved[2];
+};
+
+#define FFE_IOC_G_FENCE			_IOWR('V', BASE_VIDIOC_PRIVATE + 0, struct ffe_fence)
+
+/**
+ * struct ffe_step - advance the virtual frame clock
+ * @frames:	frame clock ticks to run, each fills a buffer or drops a frame
+ * @reserved:	must be zero
+ *
+ * Only with virtual_clock=1 and while streaming. The ticks run as fast as
+ * the frames can be filled, and buffer timestamps are the virtual time since
+ * STREAMON, so the same steps always give the same sequence and timestamps.
+ */
+struct ffe_step {
+	__u32				frames;
+	__u32				reserved[3];
+};
+
+#define FFE_IOC_STEP			_IOW('V', BASE_VIDIOC_PRIVATE + 1, struct ffe_step)
+
+/*
+ * Per-frame telemetry, mapped read-only with mmap() at FFE_TELEMETRY_OFFSET
+ * on the video node. The generator writes one record per frame clock tick.
+ * A reader loads head with acquire semantics; records head - n_records to
+ * head - 1 are valid. A record is stable when its lock is even and the same
+ * before and after reading the other fields.
+ */
+#define FFE_TELEMETRY_OFFSET		0x40000000
+#define FFE_TELEMETRY_VERSION		1
+
+#define FFE_TELEMETRY_DROPPED		0x0001	/* no buffer was queued at this tick */
+#define FFE_TELEMETRY_EXPOSURE_SHIFT	8	/* HDR exposure of the frame, 0 = longest */
+#define FFE_TELEMETRY_EXPOSURE_MASK	0x0300
+
+/**
+ * struct ffe_telemetry_header - first bytes of the telemetry mapping
+ * @version:		FFE_TELEMETRY_VERSION
+ * @record_size:	sizeof(struct ffe_telemetry_record)
+ * @n_records:		ring size, a power of two
+ * @records_offset:	offset of the first record from the start of the mapping
+ * @head:		records written so far, wraps at 2^32
+ * @reserved:		zero
+ */
+struct ffe_telemetry_header {
+	__u32				version;
+	__u32				record_size;
+	__u32				n_records;
+	__u32				records_offset;
+	__u32				head;
+	__u32				reserved[11];
+};
+
+/**
+ * struct ffe_telemetry_record - one frame clock tick
+ * @lock:		odd while the generator is writing the record
+ * @sequence:		sequence number of the frame
+ * @timestamp_ns:	buffer timestamp (frame clock deadline), CLOCK_MONOTONIC
+ * @start_ns:		when the generator handled the tick, CLOCK_MONOTONIC
+ * @fill_ns:		time spent writing the frame
+ * @queued:		buffers still queued across all consumers
+ * @delivered:		buffers completed with this frame
+ * @dropped:		frames dropped since STREAMON
+ * @flags:		FFE_TELEMETRY_*
+ * @reserved:		zero
+ */
+struct ffe_telemetry_record {
+	__u32				lock;
+	__u32				sequence;
+	__u64				timestamp_ns;
+	__u64				start_ns;
+	__u64				fill_ns;
+	__u32				queued;
+	__u32				delivered;
+	__u32				dropped;
+	__u32				flags;
+	__u64				reserved[2];
+};
+
+/*
+ * Timing trace for the "Timing Trace" control: a file of packed little-endian
+ * records, one per frame of a recorded camera, replayed in a loop as the
+ * frame schedule instead of the fixed frame interval.
+ */
+#define FFE_TRACE_DROP			0x0001	/* the camera dropped this frame */
+
+/**
+ * struct ffe_trace_record - one recorded frame
+ * @interval_ns:	time since the previous frame, at least 1 us is waited
+ * @ts_offset_ns:	signed, added to the buffer timestamp of this frame; a
+ *			timestamp that would go below zero is reported as zero
+ * @flags:		FFE_TRACE_*
+ * @reserved:		zero
+ */
+struct ffe_trace_record {
+	__le32				interval_ns;
+	__le32				ts_offset_ns;
+	__le32				flags;
+	__le32				reserved;
+};
+
+#endif /* _FFE_V4L2_H */